@@ -0,0 +1,62 @@
+/*
+ * TeensyThreads-config.h - Compile-time options for the threading library.
+ * Copyright 2017 by Fernando Trias. All rights reserved.
+ *
+ * This file is included by both TeensyThreads.h and TeensyThreads-asm.S, so
+ * it may only contain preprocessor definitions.
+ */
+
+#ifndef _THREADS_CONFIG_H
+#define _THREADS_CONFIG_H
+
+/*
+ * Where context_switch() keeps r4-r11, lr (and s0-s31, fpscr with an FPU) of
+ * a thread that is not running.
+ *
+ * By default they are copied into ThreadInfo::save, which is easy to inspect
+ * when debugging. Define THREADS_SAVE_ON_STACK to push them onto the thread's
+ * own stack instead and keep only the stack pointer in ThreadInfo. This
+ * makes every ThreadInfo smaller by sizeof(software_stack_t) and takes a
+ * pointer load out of each switch, at the cost of the same number of bytes
+ * of stack in every thread. Compare both with the Benchmark example.
+ */
+//#define THREADS_SAVE_ON_STACK
+
+/*
+ * Shared state of std::promise/std::future comes from a fixed pool instead of
+ * the heap: THREADS_FUTURE_POOL states of THREADS_FUTURE_STORAGE bytes of
+ * value each. Larger results should be returned through a pointer.
+ */
+#ifndef THREADS_FUTURE_POOL
+#define THREADS_FUTURE_POOL 8
+#endif
+#ifndef THREADS_FUTURE_STORAGE
+#define THREADS_FUTURE_STORAGE 32
+#endif
+
+/*
+ * Number of std::stop_source states, also taken from a fixed pool. Every
+ * std::jthread uses one.
+ */
+#ifndef THREADS_STOP_POOL
+#define THREADS_STOP_POOL 8
+#endif
+
+/*
+ * Threads waiting on an address (e.g. Threads::Atomic::wait()) are kept in
+ * this many buckets, chosen by a hash of the address, so that a wakeup only
+ * looks at the threads waiting in one bucket.
+ */
+#ifndef THREADS_WAIT_BUCKETS
+#define THREADS_WAIT_BUCKETS 8
+#endif
+
+/*
+ * Number of calls Threads::defer() can queue before the defer thread has
+ * run them. Must be a power of two.
+ */
+#ifndef THREADS_DEFER_QUEUE
+#define THREADS_DEFER_QUEUE 16
+#endif
+
+#endif
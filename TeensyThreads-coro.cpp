@@ -0,0 +1,112 @@
+/*
+ * TeensyThreads-coro.cpp - C++20 coroutines on top of TeensyThreads
+ * Copyright 2017 by Fernando Trias. All rights reserved.
+ *
+ * See TeensyThreads-coro.h. Compiles to nothing without C++20 coroutines so
+ * that sketches not using them build as before.
+ */
+#if defined(__cpp_impl_coroutine)
+
+#include "TeensyThreads-coro.h"
+
+namespace Coro {
+
+// Executor running in each thread, so that awaitables can find it
+Executor *Executor::running[Threads::MAX_THREADS];
+
+Executor *Executor::current()
+{
+  return running[threads.id()];
+}
+
+void Executor::executor_process(void *arg)
+{
+  ((Executor*)arg)->run();
+}
+
+int Executor::begin(int stack_size, void *stack)
+{
+  return threads.addThread(executor_process, this, stack_size, stack);
+}
+
+/*
+ * Add to the ready list; if the executor thread is blocked waiting for
+ * work, wake it
+ */
+void Executor::post(Node *node)
+{
+  node->next = 0;
+  __disable_irq();
+  if (ready_tail) ready_tail->next = node;
+  else ready_head = node;
+  ready_tail = node;
+  int id = idle_thread;
+  idle_thread = -1;
+  __enable_irq();
+  if (id != -1) threads.wake(id);
+}
+
+void Executor::addSleeper(Node *node)
+{
+  Node **p = &sleepers;
+  while (*p && (int32_t)((*p)->wake - node->wake) <= 0) p = &(*p)->next;
+  node->next = *p;
+  *p = node;
+}
+
+/*
+ * Coroutines made ready while this runs wait for the next call, so a
+ * coroutine that keeps waking another can't starve the sleepers.
+ */
+int Executor::runOnce()
+{
+  running[threads.id()] = this;
+  uint32_t now = millis();
+  while (sleepers && (int32_t)(now - sleepers->wake) >= 0) {
+    Node *node = sleepers;
+    sleepers = node->next;
+    post(node);
+  }
+  __disable_irq();
+  Node *node = ready_head;
+  ready_head = ready_tail = 0;
+  __enable_irq();
+  int count = 0;
+  while (node) {
+    Node *next = node->next;  // node is reused once the coroutine runs
+    node->handle.resume();
+    count++;
+    node = next;
+  }
+  return count;
+}
+
+/*
+ * Run forever. With nothing ready, block until the first sleeper is due, or
+ * for ever if there is none; post() wakes us earlier. A post() between
+ * setting idle_thread and blocking leaves a wake-up for block() to find.
+ */
+void Executor::run()
+{
+  int me = threads.id();
+  while(1) {
+    if (runOnce()) continue;
+    unsigned int timeout_ms = 0;
+    if (sleepers) {
+      int32_t left = sleepers->wake - millis();
+      if (left <= 0) continue;
+      timeout_ms = left;
+    }
+    __disable_irq();
+    int idle = (ready_head == 0);
+    if (idle) idle_thread = me;
+    __enable_irq();
+    if (!idle) continue;
+    threads.block(timeout_ms);
+    idle_thread = -1;
+  }
+}
+
+} // namespace Coro
+
+#endif
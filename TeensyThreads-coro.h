@@ -0,0 +1,365 @@
+/*
+ * TeensyThreads-coro.h - C++20 coroutines on top of TeensyThreads
+ * Copyright 2017 by Fernando Trias. All rights reserved.
+ *
+ * A thread with its own stack costs a kilobyte or so of RAM. Many small state
+ * machines (protocol handlers, I/O flows) can instead be written as
+ * coroutines that all run on a single thread, sharing its stack. Each
+ * coroutine only keeps its own frame (the variables that live across a
+ * co_await), allocated on the heap.
+ *
+ *   Coro::Executor executor;
+ *
+ *   Coro::Task<> blink(int pin, int ms) {
+ *     while (1) {
+ *       digitalWrite(pin, !digitalRead(pin));
+ *       co_await Coro::sleep(ms);
+ *     }
+ *   }
+ *
+ *   void setup() {
+ *     executor.spawn(blink(13, 100));
+ *     executor.begin();      // run the coroutines on a new thread
+ *   }
+ *
+ * Needs C++20 coroutines: compile with -std=gnu++20 (and -fcoroutines for
+ * GCC 10). Coroutines and the Mutex, Semaphore and Queue below must all be
+ * used from the same executor thread; only Executor::spawn() and
+ * Executor::post() may be called from other threads or interrupts.
+ */
+
+#ifndef _THREADS_CORO_H
+#define _THREADS_CORO_H
+
+#if !defined(__cpp_impl_coroutine)
+#error "TeensyThreads-coro.h needs C++20 coroutines (compile with -std=gnu++20)"
+#endif
+
+#include <Arduino.h>
+#include <coroutine>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "TeensyThreads.h"
+
+namespace Coro {
+
+class Executor;
+
+/*
+ * A suspended coroutine waiting to be resumed. Nodes live in the coroutine
+ * frame (inside the awaiter it is suspended on), so queueing never allocates.
+ */
+struct Node {
+  std::coroutine_handle<> handle;
+  Executor *executor;
+  Node *next;
+  uint32_t wake;          // millis() to wake at, for sleepers
+};
+
+/*
+ * Executor: resumes coroutines on one thread. Ready coroutines run in the
+ * order they became ready; sleepers are kept sorted by wake time.
+ */
+class Executor {
+public:
+  // Start a thread that runs the executor; returns its id or -1
+  int begin(int stack_size = -1, void *stack = 0);
+  // Run the executor in the calling thread; never returns
+  void run();
+  // Resume every ready coroutine and any sleeper that is due; returns the
+  // number resumed
+  int runOnce();
+  // Start a coroutine; the task is destroyed when it finishes
+  template <class T> void spawn(T &&task) {
+    Node *node = task.detach();
+    node->executor = this;
+    post(node);
+  }
+  // Make a suspended coroutine ready; safe from other threads and interrupts
+  void post(Node *node);
+  // Suspend until millis() reaches node->wake
+  void addSleeper(Node *node);
+  // The executor resuming coroutines in the calling thread, or 0
+  static Executor *current();
+
+protected:
+  Node *ready_head = 0;
+  Node *ready_tail = 0;
+  Node *sleepers = 0;
+  volatile int idle_thread = -1;  // thread blocked waiting for post()
+  static Executor *running[Threads::MAX_THREADS];
+  static void executor_process(void *arg);
+};
+
+/*
+ * A FIFO of waiting coroutines, used by Mutex, Semaphore and Queue
+ */
+struct WaitList {
+  Node *head = 0;
+  Node *tail = 0;
+  void add(Node *node, std::coroutine_handle<> h) {
+    node->handle = h;
+    node->executor = Executor::current();
+    node->next = 0;
+    if (tail) tail->next = node;
+    else head = node;
+    tail = node;
+  }
+  Node *take() {
+    Node *node = head;
+    if (node) {
+      head = node->next;
+      if (head == 0) tail = 0;
+    }
+    return node;
+  }
+  static void wake(Node *node) { node->executor->post(node); }
+};
+
+template <class T = void> class Task;
+
+namespace detail {
+
+struct PromiseBase {
+  Node node = {};                           // used when spawned
+  std::coroutine_handle<> continuation;     // who is awaiting us
+  bool detached = false;                    // destroy the frame when done
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <class P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      PromiseBase &p = h.promise();
+      if (p.continuation) return p.continuation;
+      if (p.detached) h.destroy();
+      return std::noop_coroutine();
+    }
+    void await_resume() noexcept { }
+  };
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { }  // exceptions are disabled on Teensy
+};
+
+template <class T> struct Promise : PromiseBase {
+  alignas(T) unsigned char storage[sizeof(T)];
+  bool has_value = false;
+  Task<T> get_return_object();
+  template <class U> void return_value(U &&value) {
+    new (storage) T(std::forward<U>(value));
+    has_value = true;
+  }
+  T &value() { return *(T*)storage; }
+  ~Promise() { if (has_value) value().~T(); }
+};
+
+template <> struct Promise<void> : PromiseBase {
+  Task<void> get_return_object();
+  void return_void() { }
+  void value() { }
+};
+
+} // namespace detail
+
+/*
+ * A coroutine returning T. A task starts when it is awaited (co_await task)
+ * or spawned on an executor; awaiting it returns the co_return value.
+ */
+template <class T> class Task {
+public:
+  using promise_type = detail::Promise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+  explicit Task(handle_type h) : handle(h) { }
+  Task(Task &&other) : handle(other.handle) { other.handle = nullptr; }
+  Task(const Task&) = delete;
+  Task &operator=(const Task&) = delete;
+  ~Task() { if (handle) handle.destroy(); }
+
+  bool await_ready() { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+    handle.promise().continuation = awaiting;
+    return handle;
+  }
+  T await_resume() {
+    if constexpr (!std::is_void_v<T>) return std::move(handle.promise().value());
+  }
+
+  // Give up ownership to an executor; see Executor::spawn()
+  Node *detach() {
+    promise_type &p = handle.promise();
+    p.detached = true;
+    p.node.handle = handle;
+    handle = nullptr;
+    return &p.node;
+  }
+
+private:
+  handle_type handle;
+};
+
+namespace detail {
+template <class T> Task<T> Promise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+} // namespace detail
+
+/*
+ * co_await sleep(ms): resume after at least ms milliseconds
+ */
+struct SleepAwaiter : Node {
+  uint32_t ms;
+  explicit SleepAwaiter(uint32_t ms) : ms(ms) { }
+  bool await_ready() { return false; }
+  void await_suspend(std::coroutine_handle<> h) {
+    handle = h;
+    executor = Executor::current();
+    wake = millis() + ms;
+    executor->addSleeper(this);
+  }
+  void await_resume() { }
+};
+
+inline SleepAwaiter sleep(uint32_t ms) { return SleepAwaiter(ms); }
+
+/*
+ * Mutex for coroutines: co_await m.lock(); ... m.unlock(). Waiters get the
+ * lock in the order they asked for it.
+ */
+class Mutex {
+public:
+  struct LockAwaiter : Node {
+    Mutex &m;
+    explicit LockAwaiter(Mutex &m) : m(m) { }
+    bool await_ready() { return m.try_lock(); }
+    void await_suspend(std::coroutine_handle<> h) { m.waiters.add(this, h); }
+    void await_resume() { }
+  };
+  LockAwaiter lock() { return LockAwaiter(*this); }
+  bool try_lock() {
+    if (locked) return false;
+    locked = true;
+    return true;
+  }
+  void unlock() {
+    Node *node = waiters.take();
+    if (node) WaitList::wake(node);   // hand the lock over directly
+    else locked = false;
+  }
+private:
+  bool locked = false;
+  WaitList waiters;
+};
+
+/*
+ * Counting semaphore for coroutines: co_await s.acquire(); ... s.release()
+ */
+class Semaphore {
+public:
+  explicit Semaphore(int count = 0) : count(count) { }
+  struct AcquireAwaiter : Node {
+    Semaphore &s;
+    explicit AcquireAwaiter(Semaphore &s) : s(s) { }
+    bool await_ready() { return s.try_acquire(); }
+    void await_suspend(std::coroutine_handle<> h) { s.waiters.add(this, h); }
+    void await_resume() { }
+  };
+  AcquireAwaiter acquire() { return AcquireAwaiter(*this); }
+  bool try_acquire() {
+    if (count <= 0) return false;
+    count--;
+    return true;
+  }
+  void release() {
+    Node *node = waiters.take();
+    if (node) WaitList::wake(node);
+    else count++;
+  }
+private:
+  int count;
+  WaitList waiters;
+};
+
+/*
+ * Bounded queue of N items of type T for coroutines:
+ * co_await q.push(value) waits while the queue is full and
+ * T value = co_await q.pop() waits while it is empty.
+ */
+template <class T, int N> class Queue {
+public:
+  struct PushAwaiter : Node {
+    Queue &q;
+    T value;
+    PushAwaiter(Queue &q, T value) : q(q), value(std::move(value)) { }
+    bool await_ready() { return q.try_push(value); }
+    void await_suspend(std::coroutine_handle<> h) { q.pushers.add(this, h); }
+    void await_resume() { }
+  };
+  struct PopAwaiter : Node {
+    Queue &q;
+    alignas(T) unsigned char storage[sizeof(T)];
+    explicit PopAwaiter(Queue &q) : q(q) { }
+    bool await_ready() { return q.try_pop((T*)storage); }
+    void await_suspend(std::coroutine_handle<> h) { q.poppers.add(this, h); }
+    T await_resume() {
+      T *item = (T*)storage;
+      T value(std::move(*item));
+      item->~T();
+      return value;
+    }
+  };
+
+  PushAwaiter push(T value) { return PushAwaiter(*this, std::move(value)); }
+  PopAwaiter pop() { return PopAwaiter(*this); }
+  int size() { return count; }
+
+  // Push without waiting; returns false if full. 'value' is moved from only
+  // on success.
+  bool try_push(T &value) {
+    PopAwaiter *popper = (PopAwaiter*)poppers.take();
+    if (popper) {
+      // someone is waiting, so the queue is empty: hand it over
+      new (popper->storage) T(std::move(value));
+      WaitList::wake(popper);
+      return true;
+    }
+    if (count == N) return false;
+    new (slot(count)) T(std::move(value));
+    count++;
+    return true;
+  }
+  // Pop into uninitialized storage at 'out' without waiting; returns false
+  // if empty
+  bool try_pop(T *out) {
+    if (count == 0) return false;
+    T *item = slot(0);
+    new (out) T(std::move(*item));
+    item->~T();
+    first = (first + 1) % N;
+    count--;
+    PushAwaiter *pusher = (PushAwaiter*)pushers.take();
+    if (pusher) {
+      // there is room now for the longest waiting pusher
+      new (slot(count)) T(std::move(pusher->value));
+      count++;
+      WaitList::wake(pusher);
+    }
+    return true;
+  }
+  ~Queue() { while (count) { slot(0)->~T(); first = (first + 1) % N; count--; } }
+
+private:
+  alignas(T) unsigned char items[N][sizeof(T)];
+  int first = 0;
+  int count = 0;
+  WaitList pushers;
+  WaitList poppers;
+  T *slot(int i) { return (T*)items[(first + i) % N]; }
+};
+
+} // namespace Coro
+
+#endif
@@ -24,21 +24,37 @@ extern "C" {
   void *currentSave;
   int currentMSP;
   void *currentSP;
-  void loadNextThread() {
-    threads.getNextThread();
+  int currentSwitchTo = -1;
+  int currentYield;
+  int currentAlone;
+  int currentCooperative;
+  int currentPendSwitch;
+  void (*currentPendSVChain)(void);
+  int loadNextThread() {
+    return threads.getNextThread();
+  }
+  int tickScheduler() {
+    return threads.tick();
   }
 }
 
-Threads::Threads() : current_thread(0), thread_count(0), thread_error(0) {
+Threads::Threads() : current_thread(0), thread_count(0), thread_error(0),
+  scheduler(ROUND_ROBIN), min_vruntime(0), slice_start(0),
+  tick_microseconds(1000), tick_count(0), next_release(0x7FFFFFFF), next_wake(0x7FFFFFFF),
+  timer_head(0), timer_thread(-1), defer_head(0), defer_tail(0), defer_thread(-1) {
   // initialize context_switch() globals from thread 0, which is MSP and always running
   currentThread = thread;        // thread 0 is active
+#ifndef THREADS_SAVE_ON_STACK
   currentSave = &thread[0].save;
+#endif
   currentMSP = 1;
   currentSP = 0;
   currentCount = Threads::DEFAULT_TICKS;
   currentActive = FIRST_RUN;
   thread[0].flags = RUNNING;
   thread[0].ticks = DEFAULT_TICKS;
+  setWeight(0, DEFAULT_WEIGHT);
+  thread[0].vruntime = 0;
   currentUseSystick = 1;
 }
 
@@ -71,44 +87,709 @@ int Threads::stop() {
 /*
  * getNextThread() - Find next running thread
  *
- * This will also set the context_switcher() state variables
+ * This will also set the context_switcher() state variables. Returns 0 if
+ * the current thread should keep running, in which case context_switch()
+ * returns without saving or restoring any registers.
  */
-void Threads::getNextThread() {
+int Threads::getNextThread() {
   // First, save the currentSP set by context_switch
   thread[current_thread].sp = currentSP;
+  int prev_thread = current_thread;
+  currentAlone = 0;
 
-  // Find any priority threads
-  int priority_thread = -1;
-  for(int i=0; i < MAX_THREADS; i++) {
-    if (thread[current_thread].flags == RUNNING) {
-      if (thread[i].priority) {
-        current_thread = i;
-        priority_thread = i;
-        currentCount = thread[i].ticks; // .priority
-        thread[i].priority = 0;
-        break;
+  // Charge the outgoing thread for the cycles it used, scaled by its weight
+  if (scheduler == FAIR_SHARE) {
+    uint32_t now = ARM_DWT_CYCCNT;
+    ThreadInfo *t = &thread[prev_thread];
+    t->vruntime += ((uint64_t)(now - slice_start) * t->inv_weight) >> 16;
+    slice_start = now;
+  }
+
+  // A direct handoff from yieldTo() skips the search for the next thread;
+  // the target inherits whatever is left of the current slice
+  int next = currentSwitchTo;
+  currentSwitchTo = -1;
+  int yielded = currentYield;
+  currentYield = 0;
+  if (next >= 0 && thread[next].flags == RUNNING) {
+    current_thread = next;
+    if (currentCount == 0) currentCount = thread[next].ticks;
+  }
+  // Periodic threads that have been released run before anything else,
+  // except that a periodic thread calling yield() lets the others run
+  else if ((next = getEarliestDeadlineThread(yielded ? prev_thread : -1)) >= 0) {
+    current_thread = next;
+    currentCount = thread[next].ticks;
+  }
+  else {
+    // Find any priority threads
+    int priority_thread = -1;
+    for(int i=0; i < MAX_THREADS; i++) {
+      if (thread[i].flags == RUNNING) {
+        if (thread[i].priority) {
+          current_thread = i;
+          priority_thread = i;
+          currentCount = thread[i].ticks; // .priority
+          thread[i].priority = 0;
+          break;
+        }
       }
     }
-  }
 
-  // If no priority threads, find next active one
-  if (priority_thread == -1) {
-    // Find the next running thread
-    while(1) {
-      current_thread++;
-      if (current_thread >= MAX_THREADS) {
-        current_thread = 0; // thread 0 is MSP; always active so return
-        break;
+    // If no priority threads, pick the one furthest behind its fair share
+    if (priority_thread == -1 && scheduler == FAIR_SHARE) {
+      int others;
+      current_thread = getFairShareThread(&others);
+      currentCount = thread[current_thread].ticks;
+      if (others == 0) currentAlone = 1;
+    }
+    // Otherwise, find next active one
+    else if (priority_thread == -1) {
+      // Find the next running thread. Thread 0 is MSP; it is picked when no
+      // thread can run, even if it is sleeping itself.
+      int i = current_thread;
+      while(1) {
+        i++;
+        if (i >= MAX_THREADS) i = 0;
+        if (thread[i].flags == RUNNING) break;
+        if (i == current_thread) {
+          i = 0;
+          break;
+        }
       }
-      if (thread[current_thread].flags == RUNNING) break;
+      current_thread = i;
+      currentCount = thread[current_thread].ticks;
+      // Came all the way around: nobody else wants the CPU, so there is no
+      // point in counting down the slice until another thread can run
+      if (current_thread == prev_thread) currentAlone = 1;
     }
-    currentCount = thread[current_thread].ticks;
   }
 
   currentThread = &thread[current_thread];
+#ifndef THREADS_SAVE_ON_STACK
   currentSave = &thread[current_thread].save;
+#endif
   currentMSP = (current_thread==0?1:0);
   currentSP = thread[current_thread].sp;
+  currentCooperative = thread[current_thread].cooperative;
+  return current_thread != prev_thread;
+}
+
+/*
+ * getFairShareThread() - Find the running thread with the lowest virtual runtime
+ *
+ * Virtual runtime is the CPU time a thread has used divided by its weight, so
+ * always running the lowest one gives each thread a share of the CPU
+ * proportional to its weight. A thread that has been asleep or suspended
+ * would otherwise come back far behind and hog the CPU, so it is brought up
+ * to min_vruntime. Sets 'others' to the number of running threads other than
+ * the current one.
+ */
+int Threads::getFairShareThread(int *others)
+{
+  int next = -1;
+  *others = 0;
+  for (int i=0; i < MAX_THREADS; i++) {
+    ThreadInfo *t = &thread[i];
+    if (t->flags != RUNNING) continue;
+    if (i != current_thread) (*others)++;
+    if ((int32_t)(t->vruntime - min_vruntime) < 0) t->vruntime = min_vruntime;
+    if (next == -1 || (int32_t)(t->vruntime - thread[next].vruntime) < 0) next = i;
+  }
+  if (next == -1) return 0; // thread 0 is MSP; always active
+  if ((int32_t)(thread[next].vruntime - min_vruntime) > 0) {
+    min_vruntime = thread[next].vruntime;
+  }
+  return next;
+}
+
+/*
+ * getEarliestDeadlineThread() - Find the released periodic thread whose
+ * deadline comes first, other than 'skip', or -1 if none is waiting to run
+ */
+int Threads::getEarliestDeadlineThread(int skip)
+{
+  int next = -1;
+  for (int i=1; i < MAX_THREADS; i++) {
+    ThreadInfo *t = &thread[i];
+    if (t->period == 0 || t->flags != RUNNING || i == skip) continue;
+    if (next == -1 || (int32_t)(t->deadline - thread[next].deadline) < 0) next = i;
+  }
+  return next;
+}
+
+/*
+ * tick() - Called by context_switch() on every tick, before the slice countdown
+ *
+ * Charges the tick to the running periodic thread; once it has used up its
+ * budget for this period, it is throttled until the next one.
+ *
+ * If a software timer is due, the timer thread is woken to run it. Sleeping
+ * threads that are due become RUNNING.
+ *
+ * Then releases the periodic threads whose next period has started. A thread
+ * still busy with the previous call, or throttled, has missed its deadline;
+ * it is counted and carries on with a fresh budget. Returns 1 if the running
+ * thread was throttled or a released thread has an earlier deadline, so that
+ * the switch happens right away, unless the running thread is cooperative.
+ * The common case of no release due is a single compare.
+ */
+int Threads::tick()
+{
+  int preempt = 0;
+  tick_count = tick_count + 1;
+
+  ThreadInfo *cur = &thread[current_thread];
+  if (cur->period && cur->budget) {
+    if (cur->flags == RUNNING && ++cur->used >= cur->budget) {
+      cur->flags = THROTTLED;
+      cur->overruns++;
+    }
+    if (cur->flags == THROTTLED) preempt = 1;
+  }
+
+  if (timer_head && (int32_t)(tick_count - timer_head->expires) >= 0) {
+    preempt |= wakeTimerThread();
+  }
+
+  if ((int32_t)(tick_count - next_wake) >= 0) wakeSleepers();
+
+  if (cur->cooperative) preempt = 0;
+  if ((int32_t)(tick_count - next_release) < 0) return preempt;
+
+  next_release = tick_count + 0x7FFFFFFF;
+  for (int i=1; i < MAX_THREADS; i++) {
+    ThreadInfo *t = &thread[i];
+    if (t->period == 0) continue;
+    if (t->flags == ENDED || t->flags == EMPTY) {
+      t->period = 0;
+      continue;
+    }
+    if ((int32_t)(tick_count - t->release) >= 0) {
+      if (t->flags == PERIODIC_WAIT) {
+        t->flags = RUNNING;
+      }
+      else {
+        if (t->flags == THROTTLED) t->flags = RUNNING;
+        else t->pending = 1;
+        t->misses++;
+      }
+      t->used = 0;
+      t->deadline = t->release + t->period;
+      t->release += t->period;
+      currentAlone = 0;
+      if (!cur->cooperative &&
+          (cur->period == 0 || (int32_t)(t->deadline - cur->deadline) < 0)) preempt = 1;
+    }
+    if ((int32_t)(t->release - next_release) < 0) next_release = t->release;
+  }
+  return preempt;
+}
+
+/*
+ * admitPeriodic() - Rate-monotonic admission test
+ *
+ * Liu & Layland: n periodic threads always meet their deadlines if their
+ * total utilisation (budget / period) is at most n(2^(1/n) - 1). Earliest
+ * deadline first can go up to 100%, so the test is on the safe side. Only
+ * threads with a budget are counted. Returns 1 if a new thread with the
+ * given period and budget (in ticks) can be added.
+ */
+static const int rm_bound[Threads::MAX_THREADS] = {
+  1000, 828, 779, 756, 743, 734, 728, 724 // per mille, for n = 1..8
+};
+
+int Threads::admitPeriodic(int period, int budget)
+{
+  if (budget == 0) return 1;
+  int n = 1;
+  int utilisation = (budget * 1000 + period - 1) / period;
+  for (int i=1; i < MAX_THREADS; i++) {
+    ThreadInfo *t = &thread[i];
+    if (t->period == 0 || t->budget == 0) continue;
+    if (t->flags == ENDED || t->flags == EMPTY) continue;
+    utilisation += (t->budget * 1000 + t->period - 1) / t->period;
+    n++;
+  }
+  return utilisation <= rm_bound[n-1];
+}
+
+/*
+ * wakeTimerThread() - Let the timer thread run the callbacks that are due
+ *
+ * It gets priority so it runs on this tick. Returns 1 if it needed waking.
+ */
+int Threads::wakeTimerThread()
+{
+  ThreadInfo *t = &thread[timer_thread];
+  if (t->flags != SUSPENDED) return 0;
+  t->flags = RUNNING;
+  t->priority = 1;
+  currentAlone = 0;
+  return 1;
+}
+
+/*
+ * wakeSleepers() - Make the sleeping threads, and blocked threads whose
+ * timeout has passed, runnable and find the next wake-up
+ */
+void Threads::wakeSleepers()
+{
+  next_wake = tick_count + 0x7FFFFFFF;
+  for (int i=0; i < MAX_THREADS; i++) {
+    ThreadInfo *t = &thread[i];
+    if (t->flags != SLEEPING && t->flags != BLOCKED) continue;
+    if ((int32_t)(tick_count - t->wake) >= 0) {
+      t->flags = RUNNING;
+      currentAlone = 0;
+    }
+    else if ((int32_t)(t->wake - next_wake) < 0) {
+      next_wake = t->wake;
+    }
+  }
+}
+
+/*
+ * sleepTicks() - Block the current thread until tick_count reaches
+ * tick_count + ticks
+ *
+ * The thread is not scheduled while SLEEPING. It keeps yielding anyway in
+ * case it is thread 0 and nobody else can run, or the sleep was ended early.
+ */
+void Threads::sleepTicks(unsigned int ticks)
+{
+  if (ticks == 0) {
+    yield();
+    return;
+  }
+  __disable_irq();
+  ThreadInfo *me = &thread[current_thread];
+  if (me->interrupted) {
+    __enable_irq();
+    return;
+  }
+  me->wake = tick_count + ticks;
+  if ((int32_t)(me->wake - next_wake) < 0) next_wake = me->wake;
+  me->flags = SLEEPING;
+  __enable_irq();
+  while (me->flags == SLEEPING) yield();
+}
+
+void Threads::sleep(unsigned int milliseconds)
+{
+  sleepTicks(msToTicks(milliseconds));
+}
+
+unsigned int Threads::msToTicks(unsigned int ms)
+{
+  uint64_t ticks = ((uint64_t)ms * 1000 + tick_microseconds - 1) / tick_microseconds;
+  return ticks < 0x7FFFFFFF ? ticks : 0x7FFFFFFF;
+}
+
+/*
+ * block() - Wait in the BLOCKED state for wake()
+ *
+ * 'woken' works like a token: wake() sets it, block() consumes it. If it is
+ * already set, block() returns at once, so a wake() between checking a
+ * condition and calling block() is not lost. Without a timeout, the thread
+ * still gets a wake-up tick as far away as possible, which just looks like
+ * a spurious wake-up to the caller.
+ */
+int Threads::block(unsigned int timeout_ms)
+{
+  return blockFor(timeout_ms, 1);
+}
+
+/*
+ * An uninterruptible block only wakes up once more after interrupt(), which
+ * looks like a spurious wake-up to the caller.
+ */
+int Threads::blockFor(unsigned int timeout_ms, int interruptible)
+{
+  unsigned int ticks = timeout_ms ? msToTicks(timeout_ms) : 0x7FFFFFFF;
+  __disable_irq();
+  ThreadInfo *me = &thread[current_thread];
+  if (interruptible && me->interrupted) {
+    __enable_irq();
+    return 0;
+  }
+  if (me->woken) {
+    me->woken = 0;
+    __enable_irq();
+    return 1;
+  }
+  me->wake = tick_count + ticks;
+  if ((int32_t)(me->wake - next_wake) < 0) next_wake = me->wake;
+  me->flags = BLOCKED;
+  __enable_irq();
+  while (me->flags == BLOCKED) yield();
+  __disable_irq();
+  int woken = me->woken;
+  me->woken = 0;
+  __enable_irq();
+  return woken;
+}
+
+void Threads::wakeMask(uint32_t mask)
+{
+  while (mask) {
+    wake(__builtin_ctz(mask));
+    mask &= mask - 1;
+  }
+}
+
+uint32_t Threads::irqDisable()
+{
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask" : "=r" (primask));
+  __disable_irq();
+  return primask;
+}
+
+void Threads::irqRestore(uint32_t state)
+{
+  if ((state & 1) == 0) __enable_irq();
+}
+
+/*
+ * Waiting on an address. Each bucket holds a mask of the threads waiting on
+ * addresses that hash to it, and each thread the address it waits on. These
+ * keep the interrupt state they were called with, so primitives can call
+ * them with interrupts disabled.
+ */
+int Threads::waitBucket(const volatile void *addr)
+{
+  uint32_t a = (uintptr_t)addr >> 2;
+  return (a ^ (a >> 7)) % THREADS_WAIT_BUCKETS;
+}
+
+void Threads::prepareWait(const volatile void *addr)
+{
+  int b = waitBucket(addr);
+  uint32_t irq = irqDisable();
+  thread[current_thread].wait_addr = addr;
+  wait_buckets[b] = wait_buckets[b] | (1 << current_thread);
+  irqRestore(irq);
+}
+
+void Threads::cancelWait()
+{
+  uint32_t irq = irqDisable();
+  ThreadInfo *me = &thread[current_thread];
+  if (me->wait_addr) {
+    int b = waitBucket(me->wait_addr);
+    wait_buckets[b] = wait_buckets[b] & ~(1 << current_thread);
+    me->wait_addr = 0;
+  }
+  irqRestore(irq);
+}
+
+int Threads::commitWait(unsigned int timeout_ms, int interruptible)
+{
+  int woken = blockFor(timeout_ms, interruptible);
+  cancelWait();
+  return woken;
+}
+
+/*
+ * Unregister the threads waiting on addr, or just the first after the
+ * current thread in thread order so that none of them starves, and return
+ * them as a mask for wakeMask().
+ */
+uint32_t Threads::takeWaiters(const volatile void *addr, int all)
+{
+  int b = waitBucket(addr);
+  uint32_t mask = 0;
+  uint32_t irq = irqDisable();
+  uint32_t waiting = wait_buckets[b];
+  while (waiting) {
+    int i = __builtin_ctz(waiting);
+    waiting &= waiting - 1;
+    int flags = thread[i].flags;
+    if (flags == ENDED || flags == ENDING || flags == EMPTY) {
+      wait_buckets[b] = wait_buckets[b] & ~(1 << i);   // killed while waiting
+      continue;
+    }
+    if (thread[i].wait_addr == addr) mask |= 1 << i;
+  }
+  if (mask && !all) {
+    uint32_t after = mask & ~((2 << current_thread) - 1);
+    mask = 1 << __builtin_ctz(after ? after : mask);
+  }
+  wait_buckets[b] = wait_buckets[b] & ~mask;
+  for (uint32_t m = mask; m; m &= m - 1) thread[__builtin_ctz(m)].wait_addr = 0;
+  irqRestore(irq);
+  return mask;
+}
+
+/*
+ * Called with interrupts disabled once the caller has found it must wait:
+ * block on addr until woken, timed out (timeout_ms from 'start', 0 for ever)
+ * or, if interruptible, interrupted. Returns with interrupts disabled again,
+ * and 0 if there is no time left or the thread was interrupted, so that the
+ * caller checks its condition once more before giving up.
+ */
+int Threads::waitLocked(const volatile void *addr, uint32_t start, unsigned int timeout_ms,
+  int interruptible)
+{
+  if (interruptible && thread[current_thread].interrupted) return 0;
+  unsigned int wait_ms = 0;
+  if (timeout_ms) {
+    uint32_t elapsed = millis() - start;
+    if (elapsed >= timeout_ms) return 0;
+    wait_ms = timeout_ms - elapsed;
+  }
+  prepareWait(addr);
+  __enable_irq();
+  commitWait(wait_ms, interruptible);
+  __disable_irq();
+  return 1;
+}
+
+/*
+ * waitOn() - Block until woken by wakeOne() or wakeAll() on the same address
+ *
+ * Returns at once if the 32-bit word at addr is not 'expected'. As with a
+ * futex, the check comes after the thread is registered, so a wake after the
+ * caller changed the value can't be missed. Returns 0 on timeout or after
+ * interrupt(); it may also return early, so check the condition in a loop.
+ */
+int Threads::waitOn(const volatile void *addr, uint32_t expected, unsigned int timeout_ms)
+{
+  prepareWait(addr);
+  if (*(const volatile uint32_t *)addr != expected || interrupted()) {
+    cancelWait();
+    return !interrupted();
+  }
+  return commitWait(timeout_ms);
+}
+
+int Threads::wakeOne(const volatile void *addr)
+{
+  uint32_t mask = takeWaiters(addr, 0);
+  wakeMask(mask);
+  return mask != 0;
+}
+
+int Threads::wakeAll(const volatile void *addr)
+{
+  uint32_t mask = takeWaiters(addr, 1);
+  wakeMask(mask);
+  return __builtin_popcount(mask);
+}
+
+int Threads::wake(int id)
+{
+  uint32_t irq = irqDisable();
+  ThreadInfo *t = &thread[id];
+  t->woken = 1;
+  int blocked = (t->flags == BLOCKED);
+  if (blocked) {
+    t->flags = RUNNING;
+    currentAlone = 0;
+  }
+  irqRestore(irq);
+  return blocked;
+}
+
+/*
+ * interrupt() - End the waits of a thread, now and in future
+ *
+ * The flag is never cleared: a thread asked to stop should not block again.
+ */
+int Threads::interrupt(int id)
+{
+  uint32_t irq = irqDisable();
+  ThreadInfo *t = &thread[id];
+  t->interrupted = 1;
+  if (t->flags == SLEEPING || t->flags == BLOCKED) {
+    t->flags = RUNNING;
+    currentAlone = 0;
+  }
+  irqRestore(irq);
+  return id;
+}
+
+int Threads::interrupted()
+{
+  return thread[current_thread].interrupted;
+}
+
+/*
+ * Shared state of std::promise and std::future
+ */
+namespace std {
+namespace threads_detail {
+
+static future_state future_pool[THREADS_FUTURE_POOL];
+
+future_state *future_state::alloc()
+{
+  future_state *s = 0;
+  uint32_t irq = Threads::irqDisable();
+  for (int i=0; i < THREADS_FUTURE_POOL; i++) {
+    if (future_pool[i].refs == 0) {
+      s = &future_pool[i];
+      s->refs = 1;
+      break;
+    }
+  }
+  Threads::irqRestore(irq);
+  if (s) {
+    s->ready = 0;
+    s->destroy = 0;
+  }
+  return s;
+}
+
+void future_state::addRef()
+{
+  uint32_t irq = Threads::irqDisable();
+  refs = refs + 1;
+  Threads::irqRestore(irq);
+}
+
+/*
+ * Drop one reference. If the promise goes before setting a value, the
+ * future is told it is broken; a future going first breaks nothing.
+ */
+void future_state::release(bool promise)
+{
+  if (promise && ready == 0 && refs > 1) set_ready(2);
+  uint32_t irq = Threads::irqDisable();
+  int left = refs - 1;
+  refs = left;
+  Threads::irqRestore(irq);
+  if (left == 0 && destroy) {
+    destroy(value);
+    destroy = 0;
+  }
+}
+
+void future_state::set_ready(int how)
+{
+  ready = how;
+  threads.wakeAll(&ready);
+}
+
+int future_state::wait(unsigned int timeout_ms, int interruptible)
+{
+  uint32_t start = millis();
+  __disable_irq();
+  while (!ready) {
+    if (!threads.waitLocked(&ready, start, timeout_ms, interruptible)) break;
+  }
+  __enable_irq();
+  return ready != 0;
+}
+
+/*
+ * Shared state of std::stop_source, std::stop_token and std::stop_callback
+ */
+static stop_state stop_pool[THREADS_STOP_POOL];
+
+stop_state *stop_state::alloc()
+{
+  stop_state *s = 0;
+  uint32_t irq = Threads::irqDisable();
+  for (int i=0; i < THREADS_STOP_POOL; i++) {
+    if (stop_pool[i].refs == 0) {
+      s = &stop_pool[i];
+      s->refs = 1;
+      break;
+    }
+  }
+  Threads::irqRestore(irq);
+  if (s) {
+    s->requested = 0;
+    s->thread = -1;
+    s->done = 0;
+    s->callbacks = 0;
+  }
+  return s;
+}
+
+void stop_state::addRef()
+{
+  uint32_t irq = Threads::irqDisable();
+  refs = refs + 1;
+  Threads::irqRestore(irq);
+}
+
+void stop_state::release()
+{
+  uint32_t irq = Threads::irqDisable();
+  refs = refs - 1;
+  Threads::irqRestore(irq);
+}
+
+/*
+ * Run the callbacks one at a time, taking each off the list with interrupts
+ * disabled, so that a stop_callback being destroyed in another thread either
+ * unlinks itself first or knows to wait for it.
+ */
+bool stop_state::request()
+{
+  uint32_t irq = Threads::irqDisable();
+  if (requested) {
+    Threads::irqRestore(irq);
+    return false;
+  }
+  requested = 1;
+  // interrupt before the thread can end and its slot be reused
+  if (thread != -1) threads.interrupt(thread);
+  Threads::irqRestore(irq);
+  while (1) {
+    irq = Threads::irqDisable();
+    stop_node *node = callbacks;
+    if (node) {
+      callbacks = node->next;
+      node->state = 1;
+    }
+    Threads::irqRestore(irq);
+    if (node == 0) break;
+    node->run(node);
+    node->state = 2;
+  }
+  return true;
+}
+
+void stop_state::add(stop_node *node)
+{
+  uint32_t irq = Threads::irqDisable();
+  if (!requested) {
+    node->state = 0;
+    node->next = callbacks;
+    callbacks = node;
+    Threads::irqRestore(irq);
+    return;
+  }
+  Threads::irqRestore(irq);
+  node->state = 1;
+  node->run(node);
+  node->state = 2;
+}
+
+void stop_state::remove(stop_node *node)
+{
+  __disable_irq();
+  if (node->state == 0) {
+    stop_node **p = &callbacks;
+    while (*p && *p != node) p = &(*p)->next;
+    if (*p) *p = node->next;
+    node->state = 2;
+  }
+  __enable_irq();
+  while (node->state == 1) threads.yield();  // running in another thread
+}
+
+}
+}
+
+unsigned int Threads::usToTicks(unsigned int us)
+{
+  unsigned int ticks = (us + tick_microseconds - 1) / tick_microseconds;
+  return ticks ? ticks : 1;
 }
 
 /*
@@ -144,6 +825,7 @@ int Threads::setMicroTimer(int tick_microseconds)
     return 0;
   }
   currentUseSystick = 0; // disable Systick calls
+  this->tick_microseconds = tick_microseconds;
   // get the PIT number [0-3] (IntervalTimer overrides IRQ_NUMBER_t op)
   int number = (IRQ_NUMBER_t)context_timer - IRQ_PIT_CH0;
   // calculate number of uint32_t per PIT; should be 4.
@@ -193,7 +875,7 @@ int Threads::setSliceMillis(int milliseconds)
 extern volatile uint32_t systick_millis_count;
 void __attribute((naked, noinline)) systick_isr(void)
 {
-  systick_millis_count++;
+  systick_millis_count = systick_millis_count + 1;
   if (currentUseSystick) {
     // we branch in order to preserve LR and the stack
     __asm volatile("b context_switch");
@@ -212,15 +894,35 @@ void __attribute((naked, noinline)) svcall_isr(void)
   register unsigned int *rsp __asm("r0");
   unsigned int svc = ((uint8_t*)rsp[6])[-2];
   if (svc == Threads::SVC_NUMBER) {
+    // as with yieldTo() below, only when there will be a switch
+    if (currentActive == Threads::STARTED) currentYield = 1;
     __asm volatile("b context_switch_direct");
   }
-  else if (svc == Threads::SVC_NUMBER_ACTIVE) {
-    currentActive = Threads::STARTED;
-    __asm volatile("b context_switch_direct_active");
+  else if (svc == Threads::SVC_NUMBER_SWITCHTO) {
+    // target thread was passed in r0; while threading is stopped there is no
+    // switch, and the handoff must not be left for a later one
+    if (currentActive == Threads::STARTED) currentSwitchTo = rsp[0];
+    __asm volatile("b context_switch_direct");
   }
   __asm volatile("bx lr");
 }
 
+/*
+ * Replaces the PendSV interrupt once beginDefer() is called, so that defer()
+ * can switch to the defer thread as soon as the interrupt calling it returns.
+ * The handler it replaced, normally the Teensy core's EventResponder, still
+ * runs first.
+ */
+static void __attribute((naked, noinline)) defer_pendsv_isr(void)
+{
+  __asm volatile("push {r0, lr} \n"
+                 "ldr r0, =currentPendSVChain \n"
+                 "ldr r0, [r0] \n"
+                 "blx r0 \n"
+                 "pop {r0, lr} \n"
+                 "b context_switch_pendsv \n");
+}
+
 /*
  * del_process() - This is called when the task returns
  *
@@ -240,14 +942,95 @@ void Threads::del_process(void)
   // }
   threads.thread_count--;
   me->flags = ENDED; //clear the flags so thread can stop and be reused
+  // A cooperative thread is never switched out by the tick, so give up the
+  // CPU now rather than spin for ever
+  me->cooperative = 0;
+  currentCooperative = 0;
   threads.start(old_state);
+  threads.yield();
   while(1); // just in case, keep working until context change when execution will not return to this thread
 }
 
 /*
- * Initializes a thread's stack. Called when thread is created
+ * periodic_process() - Body of every periodic thread
+ *
+ * Calls the job function once per period. Between calls the thread sits in
+ * PERIODIC_WAIT until tick() releases it again.
  */
-void *Threads::loadstack(ThreadFunction p, void * arg, void *stackaddr, int stack_size)
+void Threads::periodic_process(void *)
+{
+  ThreadInfo *me = &threads.thread[threads.current_thread];
+  while(1) {
+    me->job(me->job_arg);
+    __disable_irq();
+    if (me->pending) me->pending = 0; // next period already started
+    else me->flags = PERIODIC_WAIT;
+    __enable_irq();
+    while (me->flags == PERIODIC_WAIT) threads.yield();
+  }
+}
+
+/*
+ * timer_process() - Body of the timer thread
+ *
+ * Runs the callbacks of all timers that are due, rescheduling periodic ones,
+ * then suspends itself until tick() finds the next one due.
+ */
+void Threads::timer_process(void *)
+{
+  ThreadInfo *me = &threads.thread[threads.current_thread];
+  while(1) {
+    __disable_irq();
+    Timer *t = threads.timer_head;
+    if (t && (int32_t)(threads.tick_count - t->expires) >= 0) {
+      t->remove();
+      if (t->period) {
+        t->expires += t->period;
+        t->insert();
+      }
+      else {
+        t->active = 0;
+      }
+      ThreadFunction func = t->func;
+      void *func_arg = t->arg;
+      __enable_irq();
+      func(func_arg);
+      continue;
+    }
+    me->flags = SUSPENDED;
+    __enable_irq();
+    while (me->flags == SUSPENDED) threads.yield();
+  }
+}
+
+/*
+ * defer_process() - Run the calls queued by defer(), oldest first
+ *
+ * There is only one defer thread, so taking a job needs no atomic
+ * read-modify-write; only defer() has to race for slots.
+ */
+void Threads::defer_process(void *)
+{
+  const uint32_t mask = THREADS_DEFER_QUEUE - 1;
+  while(1) {
+    uint32_t p = threads.defer_head;
+    DeferJob *job = &threads.defer_jobs[p & mask];
+    if ((int32_t)(__atomic_load_n(&job->seq, __ATOMIC_ACQUIRE) - (p + 1)) < 0) {
+      threads.blockFor(0, 0);
+      continue;
+    }
+    ThreadFunction func = job->func;
+    void *func_arg = job->arg;
+    __atomic_store_n(&job->seq, p + mask + 1, __ATOMIC_RELEASE);
+    threads.defer_head = p + 1;
+    func(func_arg);
+  }
+}
+
+/*
+ * Initializes a thread's stack. Called when thread is created
+ */
+void *Threads::loadstack(ThreadFunction p, void * arg, void *stackaddr, int stack_size)
 {
   interrupt_stack_t * process_frame = (interrupt_stack_t *)((uint8_t*)stackaddr + stack_size - sizeof(interrupt_stack_t) - 8);
   process_frame->r0 = (uint32_t)arg;
@@ -259,7 +1042,13 @@ void *Threads::loadstack(ThreadFunction p, void * arg, void *stackaddr, int stac
   process_frame->pc = ((uint32_t)p);
   process_frame->xpsr = 0x1000000;
   uint8_t *ret = (uint8_t*)process_frame;
-  // ret -= sizeof(software_stack_t); // uncomment this if we are saving R4-R11 to the stack
+#ifdef THREADS_SAVE_ON_STACK
+  // The first switch to this thread pops r4-r11 and lr from its stack
+  ret -= sizeof(software_stack_t);
+  software_stack_t *software_frame = (software_stack_t *)ret;
+  memset(software_frame, 0, sizeof(software_stack_t));
+  software_frame->lr = 0xFFFFFFF9;
+#endif
   return (void*)ret;
 }
 
@@ -282,8 +1071,23 @@ void *Threads::loadstack(ThreadFunction p, void * arg, void *stackaddr, int stac
  */
 int Threads::addThread(ThreadFunction p, void * arg, int stack_size, void *stack)
 {
-  int old_state = stop();
+  return addThreadStorage(p, 0, 0, arg, stack_size, stack);
+}
+
+/*
+ * Add a new thread, first constructing storage_size bytes of data at the top
+ * of its stack with init(storage, ctx). The thread's frames go below it and
+ * the thread function gets it as its argument. Fails with -1 if the storage
+ * leaves no room on the stack.
+ */
+int Threads::addThreadStorage(ThreadFunction p, int storage_size,
+  void (*init)(void *storage, void *ctx), void *ctx, int stack_size, void *stack)
+{
   if (stack_size == -1) stack_size = DEFAULT_STACK_SIZE;
+  int reserve = (storage_size + 7) & ~7;  // keep the stack 8-byte aligned
+  int frames = sizeof(interrupt_stack_t) + 8 + sizeof(software_stack_t);
+  if (reserve + frames > stack_size) return -1;
+  int old_state = stop();
   for (int i=1; i < MAX_THREADS; i++) {
     if (thread[i].flags == ENDED || thread[i].flags == EMPTY) { // free thread
       if (thread[i].stack && thread[i].my_stack) {
@@ -298,11 +1102,29 @@ int Threads::addThread(ThreadFunction p, void * arg, int stack_size, void *stack
       }
       thread[i].stack = (uint8_t*)stack;
       thread[i].stack_size = stack_size;
-      void *psp = loadstack(p, arg, thread[i].stack, thread[i].stack_size);
+      void *arg = ctx;
+      if (reserve) {
+        arg = thread[i].stack + stack_size - reserve;
+        init(arg, ctx);
+      }
+      void *psp = loadstack(p, arg, thread[i].stack, thread[i].stack_size - reserve);
       thread[i].sp = psp;
       thread[i].ticks = DEFAULT_TICKS;
+      thread[i].period = 0;
+      thread[i].cooperative = 0;
+      thread[i].woken = 0;
+      thread[i].interrupted = 0;
+      thread[i].wait_addr = 0;
+      __disable_irq();
+      for (int b=0; b < THREADS_WAIT_BUCKETS; b++) wait_buckets[b] = wait_buckets[b] & ~(1 << i);
+      __enable_irq();
+      setWeight(i, DEFAULT_WEIGHT);
+      thread[i].vruntime = min_vruntime;
       thread[i].flags = RUNNING;
+      currentAlone = 0;
+#ifndef THREADS_SAVE_ON_STACK
       thread[i].save.lr = 0xFFFFFFF9;
+#endif
       thread[i].priority = 0;
       currentActive = old_state;
       thread_count++;
@@ -314,6 +1136,491 @@ int Threads::addThread(ThreadFunction p, void * arg, int stack_size, void *stack
   return -1;
 }
 
+/*
+ * Add a periodic thread. It is created like any other thread, running
+ * periodic_process(), and its first call starts right away. Fails with -1
+ * if it doesn't pass admitPeriodic().
+ */
+int Threads::addPeriodicThread(ThreadFunction p, unsigned int period_us, unsigned int budget_us,
+  void *arg, int stack_size, void *stack)
+{
+  int period = usToTicks(period_us);
+  int budget = budget_us ? usToTicks(budget_us) : 0;
+  int old_state = stop();
+  int id = -1;
+  if (admitPeriodic(period, budget)) {
+    id = addThread(periodic_process, 0, stack_size, stack);
+  }
+  if (id == -1) {
+    start(old_state);
+    return -1;
+  }
+  // addThread() saw threading stopped, so start it for the first thread
+  // here, as addThreadStorage() does
+  if (old_state == FIRST_RUN) old_state = STARTED;
+  ThreadInfo *t = &thread[id];
+  t->job = p;
+  t->job_arg = arg;
+  t->budget = budget;
+  t->ticks = budget ? budget - 1 : DEFAULT_TICKS;
+  t->pending = 0;
+  t->used = 0;
+  t->misses = 0;
+  t->overruns = 0;
+  __disable_irq();
+  t->release = tick_count + period;
+  t->deadline = t->release;
+  t->period = period;
+  if ((int32_t)(t->release - next_release) < 0) next_release = t->release;
+  __enable_irq();
+  start(old_state);
+  return id;
+}
+
+int Threads::getDeadlineMisses(int id)
+{
+  return thread[id].misses;
+}
+
+/*
+ * Timer list operations; called with interrupts disabled because tick()
+ * looks at the head of the list.
+ */
+void Threads::Timer::insert()
+{
+  Timer **p = &threads.timer_head;
+  while (*p && (int32_t)((*p)->expires - expires) <= 0) p = &(*p)->next;
+  next = *p;
+  *p = this;
+}
+
+void Threads::Timer::remove()
+{
+  Timer **p = &threads.timer_head;
+  while (*p && *p != this) p = &(*p)->next;
+  if (*p) *p = next;
+}
+
+int Threads::Timer::start(ThreadFunction func, unsigned int milliseconds, void *arg, int periodic)
+{
+  if (threads.timer_thread == -1) {
+    // stopped, so that two threads starting their first timers can't both
+    // create a timer thread
+    int old_state = threads.stop();
+    if (threads.timer_thread == -1) threads.timer_thread = threads.addThread(timer_process);
+    // as addThreadStorage() does, start threading with the first thread
+    if (threads.timer_thread != -1 && old_state == FIRST_RUN) old_state = STARTED;
+    threads.start(old_state);
+    if (threads.timer_thread == -1) return 0;
+  }
+  uint32_t ticks = threads.msToTicks(milliseconds);
+  __disable_irq();
+  if (active) remove();
+  this->func = func;
+  this->arg = arg;
+  period = periodic ? ticks : 0;
+  expires = threads.tick_count + ticks;
+  insert();
+  active = 1;
+  __enable_irq();
+  return 1;
+}
+
+int Threads::Timer::begin(ThreadFunction func, unsigned int milliseconds, void *arg)
+{
+  return start(func, milliseconds, arg, 1);
+}
+
+int Threads::Timer::once(ThreadFunction func, unsigned int milliseconds, void *arg)
+{
+  return start(func, milliseconds, arg, 0);
+}
+
+void Threads::Timer::end()
+{
+  __disable_irq();
+  if (active) remove();
+  active = 0;
+  __enable_irq();
+}
+
+static_assert((THREADS_DEFER_QUEUE & (THREADS_DEFER_QUEUE - 1)) == 0,
+  "THREADS_DEFER_QUEUE must be a power of two");
+
+/*
+ * beginDefer() - Start the defer thread and take over PendSV
+ *
+ * PendSV drops to the lowest priority so that it runs only once every other
+ * interrupt has returned, when a context switch is possible.
+ */
+int Threads::beginDefer(int stack_size, void *stack)
+{
+  if (defer_thread != -1) return defer_thread;
+  // stopped, so that only one defer thread is created
+  int old_state = stop();
+  if (defer_thread != -1) {
+    start(old_state);
+    return defer_thread;
+  }
+  for (int i=0; i < THREADS_DEFER_QUEUE; i++) {
+    defer_jobs[i].seq = i;
+  }
+  defer_head = 0;
+  defer_tail = 0;
+  int id = addThread(defer_process, 0, stack_size, stack);
+  if (id != -1) {
+    __disable_irq();
+    currentPendSVChain = _VectorsRam[14];
+    _VectorsRam[14] = defer_pendsv_isr;
+    SCB_SHPR3 = SCB_SHPR3 | 0x00FF0000;
+    defer_thread = id;
+    __enable_irq();
+    // as addThreadStorage() does, start threading with the first thread
+    if (old_state == FIRST_RUN) old_state = STARTED;
+  }
+  start(old_state);
+  return id;
+}
+
+/*
+ * defer() - Queue a call for the defer thread and switch to it
+ *
+ * Slots are claimed lock-free as in Pool::claim(), since an interrupt can
+ * interrupt another one in the middle of defer(). The defer thread gets
+ * priority and PendSV switches to it when the last interrupt returns.
+ */
+int Threads::defer(ThreadFunction func, void *arg)
+{
+  if (defer_thread == -1) return 0;
+  const uint32_t mask = THREADS_DEFER_QUEUE - 1;
+  uint32_t p = defer_tail;
+  DeferJob *job;
+  while(1) {
+    job = &defer_jobs[p & mask];
+    int32_t diff = (int32_t)(__atomic_load_n(&job->seq, __ATOMIC_ACQUIRE) - p);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&defer_tail, &p, p + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        break;
+      }
+    }
+    else if (diff < 0) {
+      return 0; // full
+    }
+    else {
+      p = defer_tail;
+    }
+  }
+  job->func = func;
+  job->arg = arg;
+  __atomic_store_n(&job->seq, p + 1, __ATOMIC_RELEASE);
+
+  uint32_t irq = irqDisable();
+  ThreadInfo *t = &thread[defer_thread];
+  t->woken = 1;
+  if (t->flags == BLOCKED) t->flags = RUNNING;
+  t->priority = 1;
+  currentAlone = 0;
+  currentPendSwitch = 1;
+  irqRestore(irq);
+  SCB_ICSR = SCB_ICSR_PENDSVSET;
+  return 1;
+}
+
+/*
+ * Thread pool
+ *
+ * The shared queue is a bounded multi-producer/multi-consumer ring (after
+ * Dmitry Vyukov). Every slot has a sequence number telling whether it's free
+ * for the producer at position 'pos' (seq == pos) or holds a job for the
+ * consumer at 'pos' (seq == pos + 1). Positions are claimed with
+ * compare-and-swap, which compiles to LDREX/STREX, so submitters never lock.
+ *
+ * Jobs a worker submits go to its own Chase-Lev deque instead. Only the owner
+ * touches the bottom, so pushing and popping need no compare-and-swap except
+ * for the last job; thieves compare-and-swap the top. A stolen job is moved
+ * out of its slot after the top has moved on, so the slot stays marked in use
+ * (seq != 0) until then and the owner treats it as full.
+ */
+Threads::Pool::Pool(int workers, int queue_size, int stack_size)
+  : head(0), tail(0), idle(0), pending(0), workers(0)
+{
+  uint32_t size = 1;
+  while (size < (uint32_t)queue_size) size <<= 1;
+  jobs = new Job[size];
+  mask = size - 1;
+  for (uint32_t i=0; i < size; i++) jobs[i].seq = i;
+  if (workers > MAX_THREADS) workers = MAX_THREADS;
+  deques = new Deque[workers];
+  for (int i=0; i < workers; i++) {
+    deques[i].jobs = new Job[size];
+    deques[i].top = 0;
+    deques[i].bottom = 0;
+    for (uint32_t j=0; j < size; j++) deques[i].jobs[j].seq = 0;
+  }
+  // stop so that no worker runs before 'workers' is complete
+  int old_state = threads.stop();
+  for (int i=0; i < workers; i++) {
+    int id = threads.addThread(worker_process, this, stack_size);
+    if (id == -1) break;
+    worker[this->workers++] = id;
+  }
+  // as addThreadStorage() does, start threading with the first thread
+  if (this->workers && old_state == Threads::FIRST_RUN) old_state = Threads::STARTED;
+  threads.start(old_state);
+}
+
+Threads::Pool::~Pool()
+{
+  for (int i=0; i < workers; i++) threads.kill(worker[i]);
+  for (int i=0; i < workers; i++) delete[] deques[i].jobs;
+  delete[] deques;
+  delete[] jobs;
+}
+
+/*
+ * Index of the calling thread among the workers, or -1
+ */
+int Threads::Pool::self()
+{
+  int id = threads.id();
+  for (int i=0; i < workers; i++) {
+    if (worker[i] == id) return i;
+  }
+  return -1;
+}
+
+Threads::Pool::Job *Threads::Pool::claim(uint32_t *pos, int *deque)
+{
+  int w = self();
+  if (w != -1) {
+    Deque *d = &deques[w];
+    int32_t b = d->bottom;
+    Job *job = &d->jobs[b & mask];
+    if ((uint32_t)(b - __atomic_load_n(&d->top, __ATOMIC_ACQUIRE)) <= mask && job->seq == 0) {
+      *pos = b;
+      *deque = w;
+      return job;
+    }
+    // our deque is full, so use the shared queue
+  }
+  *deque = -1;
+  uint32_t p = tail;
+  while(1) {
+    Job *job = &jobs[p & mask];
+    int32_t diff = (int32_t)(job->seq - p);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&tail, &p, p + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        *pos = p;
+        return job;
+      }
+    }
+    else if (diff < 0) {
+      return 0; // full
+    }
+    else {
+      p = tail;
+    }
+  }
+}
+
+void Threads::Pool::publish(Job *job, uint32_t pos, int deque)
+{
+  __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+  if (deque != -1) {
+    job->seq = 1;
+    __atomic_store_n(&deques[deque].bottom, (int32_t)pos + 1, __ATOMIC_RELEASE);
+  }
+  else {
+    __atomic_store_n(&job->seq, pos + 1, __ATOMIC_RELEASE);
+  }
+  wakeWorker();
+}
+
+int Threads::Pool::take(Job *out)
+{
+  uint32_t p = head;
+  while(1) {
+    Job *job = &jobs[p & mask];
+    int32_t diff = (int32_t)(__atomic_load_n(&job->seq, __ATOMIC_ACQUIRE) - (p + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&head, &p, p + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        job->manage(job, out);
+        __atomic_store_n(&job->seq, p + mask + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    }
+    else if (diff < 0) {
+      return 0; // empty
+    }
+    else {
+      p = head;
+    }
+  }
+}
+
+/*
+ * Take the newest job from the calling worker's own deque
+ */
+int Threads::Pool::pop(int deque, Job *out)
+{
+  Deque *d = &deques[deque];
+  int32_t b = d->bottom - 1;
+  __atomic_store_n(&d->bottom, b, __ATOMIC_SEQ_CST);
+  int32_t t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+  if (b - t < 0) {
+    d->bottom = t;  // empty
+    return 0;
+  }
+  Job *job = &d->jobs[b & mask];
+  if (b == t) {
+    // last job: race the thieves for it
+    int won = __atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    d->bottom = b + 1;
+    if (!won) return 0;
+  }
+  job->manage(job, out);
+  __atomic_store_n(&job->seq, 0, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+ * Take the oldest job from another worker's deque
+ */
+int Threads::Pool::steal(int deque, Job *out)
+{
+  Deque *d = &deques[deque];
+  int32_t t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+  int32_t b = __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+  if (b - t <= 0) return 0;
+  Job *job = &d->jobs[t & mask];
+  if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  job->manage(job, out);
+  __atomic_store_n(&job->seq, 0, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+ * Own deque first (most recent job, still in cache), then the shared queue,
+ * then the other workers' deques
+ */
+int Threads::Pool::takeAny(Job *out)
+{
+  int w = self();
+  if (w != -1 && pop(w, out)) return 1;
+  if (take(out)) return 1;
+  for (int i=1; i <= workers; i++) {
+    int victim = (w + i) % workers;
+    if (victim == w) continue;
+    if (steal(victim, out)) return 1;
+  }
+  return 0;
+}
+
+int Threads::Pool::empty()
+{
+  uint32_t p = head;
+  if ((int32_t)(jobs[p & mask].seq - (p + 1)) >= 0) return 0;
+  for (int i=0; i < workers; i++) {
+    if (deques[i].bottom - deques[i].top > 0) return 0;
+  }
+  return 1;
+}
+
+int Threads::Pool::submit(ThreadFunction func, void *arg)
+{
+  uint32_t pos;
+  int deque;
+  Job *job = claim(&pos, &deque);
+  if (job == 0) return 0;
+  ThreadFunction *f = (ThreadFunction*)job->storage;
+  f[0] = func;
+  ((void**)f)[1] = arg;
+  job->manage = manage_function;
+  publish(job, pos, deque);
+  return 1;
+}
+
+void Threads::Pool::manage_function(Job *job, Job *to)
+{
+  if (to) {
+    to->storage[0] = job->storage[0];
+    to->manage = job->manage;
+  }
+  else {
+    ThreadFunction func = ((ThreadFunction*)job->storage)[0];
+    func(((void**)job->storage)[1]);
+  }
+}
+
+int Threads::Pool::runOne()
+{
+  Job job;
+  if (!takeAny(&job)) return 0;
+  job.manage(&job, 0);
+  __atomic_sub_fetch(&pending, 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+ * Run jobs until *count drops to 0. A worker waiting for its own jobs this
+ * way can't deadlock the pool.
+ */
+void Threads::Pool::helpWhile(volatile int *count)
+{
+  while (*count) {
+    if (!runOne()) threads.yield();
+  }
+}
+
+/*
+ * Restart one idle worker, if any
+ */
+void Threads::Pool::wakeWorker()
+{
+  if (idle == 0) return;
+  int old_state = threads.stop();
+  if (idle) {
+    int id = __builtin_ctz(idle);
+    idle = idle & ~(1 << id);
+    threads.restart(id);
+  }
+  threads.start(old_state);
+}
+
+/*
+ * Worker thread: run jobs until there are none left, then suspend. The check
+ * for empty queues and marking the worker idle happen with threading
+ * stopped, so a job published meanwhile is either seen here or finds the
+ * worker in 'idle' and restarts it.
+ */
+void Threads::Pool::worker_process(void *arg)
+{
+  Pool *pool = (Pool*)arg;
+  int me = threads.id();
+  while(1) {
+    if (pool->runOne()) continue;
+    int old_state = threads.stop();
+    if (pool->empty()) {
+      pool->idle = pool->idle | (1 << me);
+      threads.suspend(me);
+    }
+    threads.start(old_state);
+    while (threads.getState(me) == SUSPENDED) threads.yield();
+  }
+}
+
+void Threads::Pool::wait()
+{
+  helpWhile(&pending);
+}
+
+int Threads::getBudgetOverruns(int id)
+{
+  return thread[id].overruns;
+}
+
 int Threads::getState(int id)
 {
   return thread[id].flags;
@@ -322,6 +1629,7 @@ int Threads::getState(int id)
 int Threads::setState(int id, int state)
 {
   thread[id].flags = state;
+  if (state == RUNNING) currentAlone = 0;
   return state;
 }
 
@@ -334,7 +1642,7 @@ int Threads::wait(int id, unsigned int timeout_ms)
   while (1) {
     if (timeout_ms != 0 && millis() - start > timeout_ms) return -1;
     state = thread[id].flags;
-    if (state != RUNNING) break;
+    if (state != RUNNING && state != SLEEPING && state != BLOCKED) break;
     yield();
   }
   return id;
@@ -342,6 +1650,7 @@ int Threads::wait(int id, unsigned int timeout_ms)
 
 int Threads::kill(int id)
 {
+  if (id < 0 || id >= MAX_THREADS) return -1;
   thread[id].flags = ENDED;
   return id;
 }
@@ -355,6 +1664,7 @@ int Threads::suspend(int id)
 int Threads::restart(int id)
 {
   thread[id].flags = RUNNING;
+  currentAlone = 0;
   return id;
 }
 
@@ -374,6 +1684,55 @@ void Threads::setPriority(int id, int level)
   thread[id].priority = level;
 }
 
+/*
+ * Switch between round-robin and fair-share scheduling. Fair share measures
+ * CPU time with the DWT cycle counter, so make sure it's running.
+ */
+int Threads::setScheduler(int policy)
+{
+  int old_state = stop();
+  int old_policy = scheduler;
+  if (policy == FAIR_SHARE) {
+    ARM_DEMCR = ARM_DEMCR | ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL = ARM_DWT_CTRL | ARM_DWT_CTRL_CYCCNTENA;
+    for (int i=0; i < MAX_THREADS; i++) thread[i].vruntime = 0;
+    min_vruntime = 0;
+    slice_start = ARM_DWT_CYCCNT;
+  }
+  scheduler = policy;
+  start(old_state);
+  return old_policy;
+}
+
+/*
+ * The weight is kept as its inverse, in 16.16 fixed point relative to
+ * DEFAULT_WEIGHT, so that charging CPU time on every switch is a multiply
+ * instead of a divide.
+ */
+void Threads::setWeight(int id, int weight)
+{
+  if (weight < 1) weight = 1;
+  thread[id].weight = weight;
+  thread[id].inv_weight = ((uint32_t)DEFAULT_WEIGHT << 16) / weight;
+}
+
+/*
+ * setCooperative() - Make a thread switch only when it yields or blocks
+ *
+ * context_switch() skips the slice countdown while a cooperative thread runs
+ * and tick() never asks to preempt it. Since it is only ever switched out
+ * inside yield(), the caller-saved FPU registers s0-s15 don't need saving.
+ */
+int Threads::setCooperative(int id, int cooperative)
+{
+  __disable_irq();
+  int old = thread[id].cooperative;
+  thread[id].cooperative = cooperative ? 1 : 0;
+  if (id == current_thread) currentCooperative = thread[id].cooperative;
+  __enable_irq();
+  return old;
+}
+
 void Threads::setDefaultStackSize(unsigned int bytes_size)
 {
   DEFAULT_STACK_SIZE = bytes_size;
@@ -383,13 +1742,25 @@ void Threads::yield() {
   __asm volatile("svc %0" : : "i"(Threads::SVC_NUMBER));
 }
 
-void Threads::yield_and_start() {
-  __asm volatile("svc %0" : : "i"(Threads::SVC_NUMBER_ACTIVE));
+/*
+ * yieldTo() - Hand the CPU directly to thread 'id'
+ *
+ * The target id is passed in r0 to the SVC handler so the handoff is
+ * atomic with the context switch itself.
+ */
+int Threads::yieldTo(int id) {
+  if (id == current_thread) return id;
+  if (thread[id].flags != RUNNING) {
+    yield();
+    return -1;
+  }
+  register int target __asm("r0") = id;
+  __asm volatile("svc %1" : : "r"(target), "i"(Threads::SVC_NUMBER_SWITCHTO) : "memory");
+  return id;
 }
 
 void Threads::delay(int millisecond) {
-  int mx = millis();
-  while((int)millis() - mx < millisecond) yield();
+  if (millisecond > 0) sleep(millisecond);
 }
 
 int Threads::id() {
@@ -433,51 +1804,305 @@ int Threads::Mutex::getState() {
   return ret;
 }
 
+/*
+ * The lock is only taken or handed over with interrupts disabled, and
+ * waiters wait on the mutex's address (see waitOn()), so a thread can't miss
+ * its handover between deciding to wait and blocking.
+ */
 int __attribute__ ((noinline)) Threads::Mutex::lock(unsigned int timeout_ms) {
   if (try_lock()) return 1; // we're good, so avoid more checks
 
-  uint32_t start = systick_millis_count;
+  int me = threads.current_thread;
+  uint32_t start = millis();
+  __disable_irq();
+  int relock = (owner == me);   // would deadlock; don't mistake it for a handover
   while (1) {
-    if (try_lock()) return 1;
-    if (timeout_ms && (systick_millis_count - start > timeout_ms)) return 0;
-    if (waitthread==-1) { // can hold 1 thread suspend until unlock
-      int p = threads.stop();
-      waitthread = threads.current_thread;
-      waitcount = currentCount;
-      threads.suspend(waitthread);
-      threads.start(p);
+    if (state == 0) {
+      state = 1;
+      owner = me;
+      break;
+    }
+    if (owner == me && !relock) break; // handed over by unlock()
+    // only a timed lock gives up on interrupt(); a plain one must own the
+    // lock when it returns, as callers like std::lock_guard assume
+    if (!threads.waitLocked(this, start, timeout_ms, timeout_ms != 0)) {
+      __enable_irq();
+      return 0;
     }
-    threads.yield();
   }
-  __flush_cpu();
-  return 0;
+  __enable_irq();
+  return 1;
 }
 
 int Threads::Mutex::try_lock() {
-  int p = threads.stop();
+  __disable_irq();
   if (state == 0) {
     state = 1;
-    threads.start(p);
+    owner = threads.current_thread;
+    __enable_irq();
     return 1;
   }
-  threads.start(p);
+  __enable_irq();
   return 0;
 }
 
 int __attribute__ ((noinline)) Threads::Mutex::unlock() {
-  int p = threads.stop();
-  if (state==1) {
+  int next = -1;
+  __flush_cpu();
+  __disable_irq();
+  if (state == 0) {
+    __enable_irq();
+    return 1;
+  }
+  // hand over to the next waiter after us
+  uint32_t mask = threads.takeWaiters(this, 0);
+  if (mask) {
+    next = __builtin_ctz(mask);
+    owner = next;
+  }
+  else {
     state = 0;
-    if (waitthread >= 0) { // reanimate a suspended thread waiting for unlock
-      threads.setPriority(waitthread, waitcount);
-      threads.restart(waitthread);
-      waitthread = -1;
-      __flush_cpu();
-      threads.yield_and_start();
+    owner = -1;
+  }
+  __enable_irq();
+  if (next >= 0) {
+    threads.wake(next);
+    threads.yieldTo(next);
+  }
+  return 1;
+}
+
+/*
+ * Event: set() wakes every waiter and each checks its own condition again,
+ * so set() does little work inside an interrupt.
+ */
+uint32_t Threads::Event::set(uint32_t flags) {
+  uint32_t irq = irqDisable();
+  uint32_t ret = bits | flags;
+  bits = ret;
+  irqRestore(irq);
+  threads.wakeAll(this);
+  return ret;
+}
+
+uint32_t Threads::Event::clear(uint32_t flags) {
+  uint32_t irq = irqDisable();
+  uint32_t ret = bits;
+  bits = ret & ~flags;
+  irqRestore(irq);
+  return ret;
+}
+
+uint32_t Threads::Event::wait(uint32_t flags, int options, unsigned int timeout_ms) {
+  uint32_t start = millis();
+  uint32_t ret = 0;
+  __disable_irq();
+  while (1) {
+    uint32_t match = bits & flags;
+    if ((options & ALL) ? (match == flags) : (match != 0)) {
+      ret = bits;
+      if (options & CLEAR) bits = ret & ~flags;
+      break;
+    }
+    if (!threads.waitLocked(this, start, timeout_ms)) break;
+  }
+  __enable_irq();
+  return ret;
+}
+
+Threads::Barrier::Barrier(int count, void (*completion)(void *arg), void *arg)
+  : expected(count), count(count), completion(completion), arg(arg) {
+}
+
+/*
+ * The last thread to arrive starts the next phase at once, so arrivals during
+ * the completion count towards it. The threads of a phase stay blocked until
+ * its completion returns and sets 'done'; completions run in phase order.
+ */
+uint32_t Threads::Barrier::arrive(int n) {
+  uint32_t irq = irqDisable();
+  uint32_t token = phase;
+  count = count - n;
+  if (count > 0) {
+    irqRestore(irq);
+    return token;
+  }
+  count = expected;
+  phase = token + 1;
+  while (done != token) threads.waitLocked(&done, 0, 0, 0);
+  irqRestore(irq);
+  if (completion) completion(arg);
+  irq = irqDisable();
+  done = token + 1;
+  irqRestore(irq);
+  threads.wakeAll(&done);
+  return token;
+}
+
+int Threads::Barrier::wait(uint32_t token) {
+  __disable_irq();
+  while ((int32_t)(done - token) <= 0) {
+    if (!threads.waitLocked(&done, 0, 0)) {
+      __enable_irq();
+      return 0;
+    }
+  }
+  __enable_irq();
+  return 1;
+}
+
+void Threads::Barrier::arriveAndDrop() {
+  uint32_t irq = irqDisable();
+  expected--;
+  irqRestore(irq);
+  arrive();
+}
+
+void Threads::Latch::countDown(int n) {
+  uint32_t irq = irqDisable();
+  count = count - n;
+  int done = (count <= 0);
+  irqRestore(irq);
+  if (done) threads.wakeAll(&count);
+}
+
+int Threads::Latch::wait(unsigned int timeout_ms) {
+  uint32_t start = millis();
+  __disable_irq();
+  while (count > 0) {
+    if (!threads.waitLocked(&count, start, timeout_ms)) break;
+  }
+  int ret = (count <= 0);
+  __enable_irq();
+  return ret;
+}
+
+int Threads::RecursiveMutex::lock(unsigned int timeout_ms) {
+  if (mx.getOwner() == threads.id() && count) {
+    count++;
+    return 1;
+  }
+  if (!mx.lock(timeout_ms)) return 0;
+  count = 1;
+  return 1;
+}
+
+int Threads::RecursiveMutex::try_lock() {
+  if (mx.getOwner() == threads.id() && count) {
+    count++;
+    return 1;
+  }
+  if (!mx.try_lock()) return 0;
+  count = 1;
+  return 1;
+}
+
+int Threads::RecursiveMutex::unlock() {
+  if (mx.getOwner() != threads.id() || count == 0) return 0;
+  if (--count == 0) mx.unlock();
+  return 1;
+}
+
+/*
+ * RwLock: the state is only touched with interrupts disabled, so waking
+ * threads can't race with threads deciding to wait. Writers wait on the
+ * address of 'writer', readers on that of 'readers'.
+ */
+int Threads::RwLock::getState() {
+  __disable_irq();
+  int ret = (writer != -1) ? -1 : readers;
+  __enable_irq();
+  return ret;
+}
+
+int Threads::RwLock::try_lock() {
+  __disable_irq();
+  int ok = (writer == -1 && readers == 0);
+  if (ok) writer = threads.current_thread;
+  __enable_irq();
+  return ok;
+}
+
+int Threads::RwLock::try_lock_shared() {
+  __disable_irq();
+  int ok = (writer == -1 && writers_waiting == 0);
+  if (ok) readers = readers + 1;
+  __enable_irq();
+  return ok;
+}
+
+// Called with interrupts disabled: take the waiters that may go ahead now. A
+// writer if the lock is free; otherwise all readers, unless writers wait.
+uint32_t Threads::RwLock::ready() {
+  if (writer != -1) return 0;
+  if (readers == 0) {
+    uint32_t mask = threads.takeWaiters(&writer, 0);
+    if (mask) return mask;
+  }
+  if (writers_waiting == 0) return threads.takeWaiters(&readers, 1);
+  return 0;
+}
+
+int Threads::RwLock::lock(unsigned int timeout_ms) {
+  uint32_t start = millis();
+  __disable_irq();
+  writers_waiting = writers_waiting + 1;
+  while (1) {
+    if (writer == -1 && readers == 0) {
+      writer = threads.current_thread;
+      writers_waiting = writers_waiting - 1;
+      __enable_irq();
       return 1;
     }
+    if (!threads.waitLocked(&writer, start, timeout_ms, timeout_ms != 0)) break;
   }
-  __flush_cpu();
-  threads.start(p);
+  // giving up: pass on a wakeup we may have taken, and let readers go if
+  // they were only waiting for us
+  writers_waiting = writers_waiting - 1;
+  uint32_t mask = ready();
+  __enable_irq();
+  threads.wakeMask(mask);
+  return 0;
+}
+
+int Threads::RwLock::lock_shared(unsigned int timeout_ms) {
+  uint32_t start = millis();
+  __disable_irq();
+  while (1) {
+    if (writer == -1 && writers_waiting == 0) {
+      readers = readers + 1;
+      __enable_irq();
+      return 1;
+    }
+    if (!threads.waitLocked(&readers, start, timeout_ms, timeout_ms != 0)) {
+      __enable_irq();
+      return 0;
+    }
+  }
+}
+
+int Threads::RwLock::unlock() {
+  __disable_irq();
+  if (writer == -1) {
+    __enable_irq();
+    return 0;
+  }
+  writer = -1;
+  uint32_t mask = ready();
+  __enable_irq();
+  threads.wakeMask(mask);
+  return 1;
+}
+
+int Threads::RwLock::unlock_shared() {
+  __disable_irq();
+  if (readers == 0) {
+    __enable_irq();
+    return 0;
+  }
+  readers = readers - 1;
+  uint32_t mask = ready();
+  __enable_irq();
+  threads.wakeMask(mask);
   return 1;
 }
@@ -11,7 +11,13 @@
 #define _THREADS_H
 
 #include <stdint.h>
+#include <chrono>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include "../../../../../arduino/avr/cores/arduino/WString.h"
+#include "TeensyThreads-config.h"
 
 //#include <utility>
 
@@ -20,7 +26,12 @@ extern "C" {
 	void context_switch_direct(void);
 	void context_switch_pit_isr(void);
 	void systick_isr(void);
-	void loadNextThread();
+	int loadNextThread();
+	int tickScheduler();
+}
+
+namespace std {
+	namespace threads_detail { struct future_state; struct stop_state; }
 }
 
 // The stack frame saved by the interrupt
@@ -35,7 +46,9 @@ typedef struct {
 	uint32_t xpsr;
 } interrupt_stack_t;
 
-// The stack frame saved by the context switch
+// The stack frame saved by the context switch; either in ThreadInfo::save or,
+// with THREADS_SAVE_ON_STACK, on the thread's own stack just below the
+// interrupt frame
 typedef struct {
 	uint32_t r4;
 	uint32_t r5;
@@ -83,23 +96,45 @@ typedef struct {
 #endif
 } software_stack_t;
 
+typedef void(*ThreadFunction)(void*);
+typedef void(*ThreadFunctionInt)(int);
+typedef void(*ThreadFunctionNone)();
+
 // The state of each thread (including thread 0)
 class ThreadInfo {
 public:
 	int stack_size;
 	uint8_t *stack = 0;
 	int my_stack = 0;
+#ifndef THREADS_SAVE_ON_STACK
 	software_stack_t save;
+#endif
 	volatile int flags = 0;
 	int priority = 0;
 	void *sp;
 	int ticks;
+	uint32_t wake;          // tick to wake at while SLEEPING or BLOCKED
+	volatile int woken;     // wake() was called; see Threads::block()
+	volatile int interrupted;   // see Threads::interrupt()
+	const volatile void *wait_addr; // address waited on; see Threads::prepareWait()
+	int cooperative = 0;    // see Threads::setCooperative()
+	// fair-share scheduling; see Threads::setScheduler()
+	int weight;
+	uint32_t inv_weight;
+	uint32_t vruntime;
+	// periodic threads; see Threads::addPeriodicThread(). Times are in ticks.
+	int period = 0;
+	int budget;
+	uint32_t release;
+	uint32_t deadline;
+	int pending;
+	int used;
+	int misses;
+	int overruns;
+	ThreadFunction job;
+	void *job_arg;
 };
 
-typedef void(*ThreadFunction)(void*);
-typedef void(*ThreadFunctionInt)(int);
-typedef void(*ThreadFunctionNone)();
-
 /*
 * Threads handles all the threading interaction with users. It gets
 * instantiated in a global variable "threads".
@@ -124,14 +159,44 @@ public:
 	static const int ENDED = 2;
 	static const int ENDING = 3;
 	static const int SUSPENDED = 4;
+	static const int PERIODIC_WAIT = 5;
+	static const int THROTTLED = 6;
+	static const int SLEEPING = 7;
+	static const int BLOCKED = 8;
+
+	// Scheduling policy; see setScheduler()
+	static const int ROUND_ROBIN = 0;
+	static const int FAIR_SHARE = 1;
+	static const int DEFAULT_WEIGHT = 1024;
+
+	class Timer;
 
 	static const int SVC_NUMBER = 0x21;
-	static const int SVC_NUMBER_ACTIVE = 0x22;
+	static const int SVC_NUMBER_SWITCHTO = 0x23;
 
 protected:
 	int current_thread;
 	int thread_count;
 	int thread_error;
+	int scheduler;
+	uint32_t min_vruntime;  // virtual runtime of the thread furthest behind
+	uint32_t slice_start;   // cycle count when the current thread was switched in
+	int tick_microseconds;
+	volatile uint32_t tick_count;
+	uint32_t next_release;  // tick of the earliest periodic release
+	uint32_t next_wake;     // tick of the earliest sleeping thread's wake
+	Timer *timer_head;      // active software timers, soonest first
+	int timer_thread;       // thread running timer callbacks; -1 until needed
+	volatile uint32_t wait_buckets[THREADS_WAIT_BUCKETS] = {};  // masks of threads waiting on an address
+	struct DeferJob {
+		volatile uint32_t seq;  // ring position the slot is free or ready for
+		ThreadFunction func;
+		void *arg;
+	};
+	DeferJob defer_jobs[THREADS_DEFER_QUEUE];  // calls queued by defer()
+	uint32_t defer_head;    // next job the defer thread runs
+	volatile uint32_t defer_tail;  // next free slot for defer()
+	int defer_thread;       // thread running deferred calls; -1 until beginDefer()
 
 	/*
 	* The maximum number of threads is hard-coded. Alternatively, we could implement
@@ -191,6 +256,32 @@ public:
 	int addThread(ThreadFunctionNone p, int arg = 0, int stack_size = -1, void *stack = 0) {
 		return addThread((ThreadFunction)p, (void*)arg, stack_size, stack);
 	}
+	// Like addThread(), but first reserves storage_size bytes at the top of the new thread's
+	// stack and calls init(storage, ctx), with threading stopped, to fill them in. "p" gets
+	// the storage as its argument. If storage_size is 0, "p" gets ctx instead. Used by
+	// std::thread to keep the callable and its arguments without a heap allocation.
+	int addThreadStorage(ThreadFunction p, int storage_size, void (*init)(void *storage, void *ctx),
+		void *ctx, int stack_size = -1, void *stack = 0);
+
+	// Create a thread that calls "p" once every period_us microseconds. Periodic threads
+	// run ahead of all others, earliest deadline first; the deadline of each call is the
+	// start of the next period. budget_us is the most CPU time each period may use: it
+	// is the thread's time slice, and a call that uses it up is throttled until the next
+	// period. Returns -1 if the new thread would make the periodic threads fail the
+	// rate-monotonic utilisation bound. With budget_us of 0 there is neither check nor
+	// limit. Timing is in ticks, so use setMicroTimer() for periods shorter than a few
+	// milliseconds.
+	int addPeriodicThread(ThreadFunction p, unsigned int period_us, unsigned int budget_us,
+		void *arg = 0, int stack_size = -1, void *stack = 0);
+	// For: void f()
+	int addPeriodicThread(ThreadFunctionNone p, unsigned int period_us, unsigned int budget_us,
+		int stack_size = -1, void *stack = 0) {
+		return addPeriodicThread((ThreadFunction)p, period_us, budget_us, 0, stack_size, stack);
+	}
+	// Number of times a periodic thread was still running at the end of its period
+	int getDeadlineMisses(int id);
+	// Number of times a periodic thread was throttled for using up its budget
+	int getBudgetOverruns(int id);
 
 	// Get the state; see class constants. Can be EMPTY, RUNNING, etc.
 	int getState(int id);
@@ -211,6 +302,17 @@ public:
 	void setDefaultTimeSlice(unsigned int ticks);
 	// Set the stack size for new threads in bytes
 	void setDefaultStackSize(unsigned int bytes_size);
+	// Choose how the next thread is picked: ROUND_ROBIN (the default) or FAIR_SHARE,
+	// which runs the thread that has had the least CPU time for its weight.
+	// Returns the previous policy.
+	int setScheduler(int policy);
+	// Set the fair-share weight of a thread; a thread with twice the weight gets
+	// twice the CPU time of the others (default is DEFAULT_WEIGHT)
+	void setWeight(int id, int weight);
+	// Make a thread cooperative (1) or preemptive (0, the default). A cooperative thread
+	// is never preempted by the tick; it runs until it yields or blocks. Returns the
+	// previous setting.
+	int setCooperative(int id, int cooperative = 1);
 	// Use the microsecond timer provided by IntervalTimer & PIT; instead of 1 tick = 1 millisecond,
 	// 1 tick will be the number of microseconds provided (default is 100 microseconds)
 	int setMicroTimer(int tick_microseconds = DEFAULT_TICK_MICROSECONDS);
@@ -231,8 +333,51 @@ public:
 	// Yield current thread's remaining time slice to the next thread, causing immediate
 	// context switch
 	void yield();
-	// Wait for milliseconds using yield(), giving other slices your wait time
+	// Yield directly to thread 'id', which gets the rest of the current time slice.
+	// Returns -1 and does a normal yield() if 'id' is not running.
+	int yieldTo(int id);
+	// Wait for milliseconds; the thread sleeps and is not scheduled until then
 	void delay(int millisecond);
+	// Block the current thread for 'milliseconds' (rounded up to whole ticks) in the
+	// SLEEPING state. Another thread can end the sleep early with restart().
+	void sleep(unsigned int milliseconds);
+	// Block the current thread until 'ticks' more ticks have happened
+	void sleepTicks(unsigned int ticks);
+	// Block the current thread in the BLOCKED state until another thread or an interrupt
+	// calls wake() for it, or timeout_ms passes (0 waits for ever). Returns 1 if woken, 0
+	// on timeout. A wake() that comes before block() makes it return right away, so
+	// check the condition you are waiting for in a loop around block().
+	int block(unsigned int timeout_ms = 0);
+	// Wake a thread from block(); safe to call from interrupts. Returns 1 if it was blocked.
+	int wake(int id);
+	// Ask a thread to stop waiting, e.g. to shut it down cleanly. It is woken from sleep() or
+	// block(), and from then on these, delay(), timed locks and future waits return early
+	// without waiting. Plain Mutex and RwLock locks and future::get() still wait until they
+	// succeed. Safe to call from interrupts.
+	int interrupt(int id);
+	// Returns 1 if the current thread has been interrupted
+	int interrupted();
+	// Wait on an address, like a Linux futex: block until another thread or an interrupt
+	// calls wakeOne() or wakeAll() with the same address, unless the 32-bit value there is no
+	// longer 'expected'. Returns 0 on timeout (0 = none) or interrupt(). It may return early,
+	// so check your condition in a loop around it.
+	int waitOn(const volatile void *addr, uint32_t expected, unsigned int timeout_ms = 0);
+	// Wake one or all threads in waitOn(addr); safe to call from interrupts. Returns the
+	// number woken.
+	int wakeOne(const volatile void *addr);
+	int wakeAll(const volatile void *addr);
+	// Start the thread that runs the calls queued by defer(); call it once from setup()
+	// before using defer() in an interrupt. Returns its id, or -1 on error.
+	int beginDefer(int stack_size = -1, void *stack = 0);
+	// Queue func(arg) to run in a thread as soon as possible, ahead of the other threads;
+	// for interrupts with more work than belongs in an interrupt. Safe to call from
+	// interrupts. Returns 0 if the queue is full or beginDefer() has not been called.
+	int defer(ThreadFunction func, void *arg = 0);
+	int defer(ThreadFunctionNone func) {
+		return defer((ThreadFunction)func);
+	}
+	// Length of a tick in microseconds; see setMicroTimer()
+	int getTickMicros() { return tick_microseconds; }
 
 	// Start/restart threading system; returns previous state: STARTED, STOPPED, FIRST_RUN
 	// can pass the previous state to restore
@@ -245,17 +390,46 @@ public:
 	friend void context_switch_direct(void);
 	friend void context_pit_isr(void);
 	friend void systick_isr(void);
-	friend void loadNextThread();
+	friend int loadNextThread();
+	friend int tickScheduler();
 	friend class ThreadLock;
+	friend class Timer;
+	friend struct std::threads_detail::future_state;
+	friend struct std::threads_detail::stop_state;
 
 protected:
-	void getNextThread();
+	int getNextThread();
+	int getFairShareThread(int *others);
+	int getEarliestDeadlineThread(int skip);
+	int admitPeriodic(int period, int budget);
+	int tick();
+	unsigned int usToTicks(unsigned int us);
+	int wakeTimerThread();
+	int blockFor(unsigned int timeout_ms, int interruptible);
+	void wakeSleepers();
+	void wakeMask(uint32_t mask);  // wake() every thread in a mask of thread ids
+	// Waiting on an address; see waitOn(). Register with prepareWait(), check the
+	// condition, then commitWait() to block or cancelWait() if there is no need. A
+	// wake after prepareWait() can't be missed.
+	static int waitBucket(const volatile void *addr);
+	void prepareWait(const volatile void *addr);
+	int commitWait(unsigned int timeout_ms, int interruptible = 1);
+	void cancelWait();
+	uint32_t takeWaiters(const volatile void *addr, int all);
+	int waitLocked(const volatile void *addr, uint32_t start, unsigned int timeout_ms,
+		int interruptible = 1);
+	// Disable interrupts, returning whether they were enabled, and restore them
+	static uint32_t irqDisable();
+	static void irqRestore(uint32_t state);
+	unsigned int msToTicks(unsigned int ms);
 	void *loadstack(ThreadFunction p, void * arg, void *stackaddr, int stack_size);
 	static void force_switch_isr();
 
 private:
 	static void del_process(void);
-	void yield_and_start();
+	static void periodic_process(void *arg);
+	static void timer_process(void *arg);
+	static void defer_process(void *arg);
 	//ADDED by CWA 05/18/2017
 	//TODO: Finish adding linked list for Threads.
 	threadStruct* head;
@@ -264,18 +438,298 @@ private:
 
 
 public:
+	/*
+	* Mutex. Threads waiting for it are blocked (see waitOn()), and unlock() hands
+	* it straight to the next waiter, which then runs for the rest of the
+	* unlocking thread's time slice.
+	*/
 	class Mutex {
 	private:
 		volatile int state = 0;
-		volatile int waitthread = -1;
-		volatile int waitcount = 0;
+		volatile int owner = -1;
 	public:
 		int getState(); // get the lock state; 1=locked; 0=unlocked
+		int getOwner() { return owner; } // thread holding the lock, or -1
 		int lock(unsigned int timeout_ms = 0); // lock, optionally waiting up to timeout_ms milliseconds
 		int try_lock(); // if lock available, get it and return 1; otherwise return 0
 		int unlock();   // unlock if locked
 	};
 
+	/*
+	* Mutex that the thread holding it may lock again; it is released when
+	* unlocked as many times as it was locked.
+	*/
+	class RecursiveMutex {
+	private:
+		Mutex mx;
+		int count = 0;
+	public:
+		int getState() { return count; } // number of times locked; 0=unlocked
+		int getOwner() { return mx.getOwner(); }
+		int lock(unsigned int timeout_ms = 0);
+		int try_lock();
+		int unlock();   // returns 0 if not held by this thread
+	};
+
+	/*
+	* Reader-writer lock: any number of threads may hold it shared, for reading,
+	* or one thread exclusively, for writing. Writers are preferred: once one is
+	* waiting, new readers wait too. Waiting threads are blocked (see waitOn())
+	* until they may proceed.
+	*/
+	class RwLock {
+	private:
+		volatile int readers = 0;          // threads holding it shared
+		volatile int writer = -1;          // thread holding it exclusively, or -1
+		volatile int writers_waiting = 0;  // threads in lock(), not yet holding it
+		uint32_t ready();
+	public:
+		int getState(); // number of readers; -1 if locked for writing; 0 if unlocked
+		// lock for writing, optionally waiting up to timeout_ms milliseconds; returns 1 if locked
+		int lock(unsigned int timeout_ms = 0);
+		int try_lock();
+		int unlock();
+		// lock for reading, optionally waiting up to timeout_ms milliseconds; returns 1 if locked
+		int lock_shared(unsigned int timeout_ms = 0);
+		int try_lock_shared();
+		int unlock_shared();
+	};
+
+	/*
+	* Event group: 32 flags set by threads or interrupts, and waited on by
+	* threads, which are blocked until the flags they want are set. Use it in
+	* place of polling several volatile variables.
+	*/
+	class Event {
+	private:
+		volatile uint32_t bits = 0;
+	public:
+		// Options for wait(); combine with |
+		static const int ANY = 0;         // wait for any of the flags
+		static const int ALL = 1;         // wait for all of the flags
+		static const int CLEAR = 2;       // clear the flags waited for when returning
+		// Set flags and wake threads waiting for them; safe to call from interrupts.
+		// Returns the flags after setting.
+		uint32_t set(uint32_t flags);
+		// Clear flags; returns the flags before clearing
+		uint32_t clear(uint32_t flags);
+		uint32_t get() { return bits; }
+		// Wait until any (or all) of 'flags' are set, up to timeout_ms milliseconds (0 for
+		// ever). Returns all the flags as they were when the wait ended, or 0 on timeout.
+		uint32_t wait(uint32_t flags, int options = ANY, unsigned int timeout_ms = 0);
+	};
+
+	/*
+	* Barrier for a fixed number of threads, used over and over: each phase
+	* ends when all of them have arrived. The last thread to arrive calls the
+	* completion function, if any, and then releases all the others at once.
+	*/
+	class Barrier {
+	private:
+		int expected;
+		volatile int count;
+		volatile uint32_t phase = 0;  // phase threads are arriving for
+		volatile uint32_t done = 0;   // phases before this one have completed
+		void (*completion)(void *arg);
+		void *arg;
+	public:
+		Barrier(int count, void (*completion)(void *arg) = 0, void *arg = 0);
+		// Arrive without waiting, counting as n threads; returns the phase to pass to wait()
+		uint32_t arrive(int n = 1);
+		// Wait until 'phase' has ended; returns 0 if interrupted
+		int wait(uint32_t phase);
+		int arriveAndWait() { return wait(arrive()); }
+		// Arrive, and leave the barrier: later phases wait for one thread less
+		void arriveAndDrop();
+	};
+
+	/*
+	* Count down latch: threads wait until it has been counted down to zero, once.
+	*/
+	class Latch {
+	private:
+		volatile int count;
+	public:
+		Latch(int count) : count(count) { }
+		// Count down by n and release the waiting threads at zero; safe to call from interrupts
+		void countDown(int n = 1);
+		int tryWait() { return count <= 0; }
+		// Wait until zero, up to timeout_ms milliseconds (0 for ever); returns 1 if zero
+		int wait(unsigned int timeout_ms = 0);
+		int arriveAndWait(int n = 1) { countDown(n); return wait(); }
+	};
+
+	template <class T, bool LockFree = __atomic_always_lock_free(sizeof(T), 0)> class AtomicStorage;
+	template <class T> class Atomic;
+
+	/*
+	* Software timer. Callbacks of all timers run one after the other on a single
+	* timer thread, created the first time a timer is started, so a timeout costs
+	* no stack or thread of its own. Callbacks run with threading and interrupts
+	* enabled and should return quickly. Times are rounded up to whole ticks.
+	*/
+	class Timer {
+	private:
+		Timer *next;
+		uint32_t expires;      // tick of next expiry
+		uint32_t period;       // ticks between expiries; 0 for one-shot
+		ThreadFunction func;
+		void *arg;
+		volatile int active = 0;
+		void insert();
+		void remove();
+		friend class Threads;
+	public:
+		~Timer() { end(); }
+		// Call func(arg) every 'milliseconds'; restarts the timer if already active
+		int begin(ThreadFunction func, unsigned int milliseconds, void *arg = 0);
+		int begin(ThreadFunctionNone func, unsigned int milliseconds) {
+			return begin((ThreadFunction)func, milliseconds);
+		}
+		// Call func(arg) once, 'milliseconds' from now
+		int once(ThreadFunction func, unsigned int milliseconds, void *arg = 0);
+		int once(ThreadFunctionNone func, unsigned int milliseconds) {
+			return once((ThreadFunction)func, milliseconds);
+		}
+		void end();             // stop the timer if active
+		int isActive() { return active; }
+	private:
+		int start(ThreadFunction func, unsigned int milliseconds, void *arg, int periodic);
+	};
+
+	/*
+	* Pool of worker threads running jobs from a queue. Creating the workers up
+	* front means a job costs no stack allocation or thread setup. Jobs are
+	* either a function and argument, or any callable up to JOB_STORAGE bytes
+	* (e.g. a lambda capturing a few pointers), stored in the queue slot
+	* itself. Jobs submitted by other threads go to a shared lock-free queue;
+	* jobs submitted by a worker go to its own deque, where it takes the newest
+	* first while idle workers steal the oldest. Idle workers are suspended
+	* until there is work.
+	*/
+	class Pool {
+	public:
+		static const int JOB_STORAGE = 16;
+		// Start 'workers' threads; the shared queue and each worker's deque hold
+		// 'queue_size' jobs (rounded up to a power of two)
+		Pool(int workers, int queue_size = 16, int stack_size = -1);
+		~Pool();
+		// Queue func(arg); returns 0 if the queue is full
+		int submit(ThreadFunction func, void *arg = 0);
+		// Queue a callable f(); returns 0 if the queue is full
+		template <class F> int submit(F f) {
+			static_assert(sizeof(F) <= JOB_STORAGE, "callable too large for a Pool job");
+			uint32_t pos;
+			int deque;
+			Job *job = claim(&pos, &deque);
+			if (job == 0) return 0;
+			new (job->storage) F(std::move(f));
+			job->manage = manage_callable<F>;
+			publish(job, pos, deque);
+			return 1;
+		}
+		// Wait until every job submitted so far has run, helping to run them
+		void wait();
+		// Run one queued job in the calling thread; returns 0 if there was none
+		int runOne();
+		// Call body(i) for begin <= i < end, splitting the range into jobs of at
+		// least 'grain' iterations. Returns when all have run.
+		template <class F> void parallel_for(int begin, int end, F body, int grain = 1) {
+			ForRange<F> range = { this, &body, 0, grain < 1 ? 1 : grain };
+			split_for(&range, begin, end);
+			helpWhile(&range.pending);
+		}
+		// Call every function given, in parallel. Returns when all have run.
+		template <class F, class... G> void parallel_invoke(F f, G... g) {
+			volatile int count = 0;
+			invoke_rest(&count, g...);
+			f();
+			helpWhile(&count);
+		}
+	protected:
+		struct Job {
+			volatile uint32_t seq;
+			// run and destroy the job, or if 'to' is set, move it there
+			void (*manage)(Job *job, Job *to);
+			uint64_t storage[JOB_STORAGE / 8];
+		};
+		// Chase-Lev deque of one worker. Its owner pushes and pops at 'bottom';
+		// other threads steal at 'top'. Job::seq marks a slot still in use.
+		struct Deque {
+			Job *jobs;
+			volatile int32_t top;
+			volatile int32_t bottom;
+		};
+		Job *jobs;
+		Deque *deques;
+		uint32_t mask;
+		volatile uint32_t head;
+		volatile uint32_t tail;
+		volatile uint32_t idle;     // bit mask of suspended worker threads
+		volatile int pending;       // jobs submitted but not finished
+		int worker[MAX_THREADS];
+		int workers;
+		int self();
+		Job *claim(uint32_t *pos, int *deque);
+		void publish(Job *job, uint32_t pos, int deque);
+		int take(Job *job);
+		int pop(int deque, Job *job);
+		int steal(int deque, Job *job);
+		int takeAny(Job *job);
+		int empty();
+		void wakeWorker();
+		void helpWhile(volatile int *count);
+		static void worker_process(void *arg);
+		static void manage_function(Job *job, Job *to);
+		template <class F> static void manage_callable(Job *job, Job *to) {
+			F *f = (F*)job->storage;
+			if (to) {
+				new (to->storage) F(std::move(*f));
+				to->manage = job->manage;
+			}
+			else {
+				(*f)();
+			}
+			f->~F();
+		}
+		template <class F> struct ForRange {
+			Pool *pool;
+			F *body;
+			volatile int pending;
+			int grain;
+		};
+		// Hand the upper half of the range to the pool until what is left is one
+		// grain, then run that here. If the pool is full, run everything here.
+		template <class F> static void split_for(ForRange<F> *range, int begin, int end) {
+			while (end - begin > range->grain) {
+				int mid = begin + (end - begin) / 2;
+				__atomic_add_fetch(&range->pending, 1, __ATOMIC_RELAXED);
+				if (!range->pool->submit([range, mid, end]() {
+					split_for(range, mid, end);
+					__atomic_sub_fetch(&range->pending, 1, __ATOMIC_RELEASE);
+				})) {
+					__atomic_sub_fetch(&range->pending, 1, __ATOMIC_RELAXED);
+					break;
+				}
+				end = mid;
+			}
+			for (int i = begin; i < end; i++) (*range->body)(i);
+		}
+		void invoke_rest(volatile int *) { }
+		template <class F, class... G> void invoke_rest(volatile int *count, F &f, G&... g) {
+			__atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+			F *fp = &f;
+			if (!submit([fp, count]() {
+				(*fp)();
+				__atomic_sub_fetch(count, 1, __ATOMIC_RELEASE);
+			})) {
+				__atomic_sub_fetch(count, 1, __ATOMIC_RELAXED);
+				f();
+			}
+			invoke_rest(count, g...);
+		}
+	};
+
 	class Scope {
 	private:
 		Mutex *r;
@@ -321,6 +775,139 @@ public:
 };
 extern Threads threads;
 
+/*
+* Storage of Threads::Atomic. Types the CPU can update atomically (1, 2 and 4
+* bytes on Cortex-M4) use the __atomic builtins, i.e. LDREX/STREX; others are
+* updated with interrupts disabled.
+*/
+template <class T> class Threads::AtomicStorage<T, true> {
+protected:
+	alignas(sizeof(T)) T value;
+	AtomicStorage(T v) : value(v) { }
+	T get() const {
+		T ret;
+		__atomic_load(&value, &ret, __ATOMIC_SEQ_CST);
+		return ret;
+	}
+	void set(T v) { __atomic_store(&value, &v, __ATOMIC_SEQ_CST); }
+	T swap(T v) {
+		T ret;
+		__atomic_exchange(&value, &v, &ret, __ATOMIC_SEQ_CST);
+		return ret;
+	}
+	bool cas(T& expected, T desired, bool weak) {
+		return __atomic_compare_exchange(&value, &expected, &desired, weak,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+	// Replace the value with op(value); returns the old value
+	template <class Op> T update(Op op) {
+		T old = get();
+		while (!cas(old, op(old), true));
+		return old;
+	}
+public:
+	static const bool is_always_lock_free = true;
+};
+
+template <class T> class Threads::AtomicStorage<T, false> {
+protected:
+	T value;
+	AtomicStorage(T v) : value(v) { }
+	T get() const {
+		uint32_t irq = Threads::irqDisable();
+		T ret = value;
+		Threads::irqRestore(irq);
+		return ret;
+	}
+	void set(T v) {
+		uint32_t irq = Threads::irqDisable();
+		value = v;
+		Threads::irqRestore(irq);
+	}
+	T swap(T v) {
+		uint32_t irq = Threads::irqDisable();
+		T ret = value;
+		value = v;
+		Threads::irqRestore(irq);
+		return ret;
+	}
+	bool cas(T& expected, T desired, bool weak) {
+		uint32_t irq = Threads::irqDisable();
+		bool ok = (__builtin_memcmp(&value, &expected, sizeof(T)) == 0);
+		if (ok) value = desired;
+		else expected = value;
+		Threads::irqRestore(irq);
+		return ok;
+	}
+	template <class Op> T update(Op op) {
+		uint32_t irq = Threads::irqDisable();
+		T old = value;
+		value = op(old);
+		Threads::irqRestore(irq);
+		return old;
+	}
+public:
+	static const bool is_always_lock_free = false;
+};
+
+/*
+* Atomic variable with the members of std::atomic. All operations are
+* sequentially consistent (there are no memory_order arguments). Safe to use
+* from interrupts, except for wait().
+*
+* wait() blocks the thread until the value is no longer 'old' and
+* notify_one()/notify_all() is called, so a thread can wait on a flag or
+* counter without polling.
+*/
+template <class T> class Threads::Atomic : public Threads::AtomicStorage<T> {
+	typedef Threads::AtomicStorage<T> base;
+public:
+	Atomic() : base(T()) { }
+	Atomic(T v) : base(v) { }
+	Atomic(const Atomic&) = delete;
+	Atomic& operator=(const Atomic&) = delete;
+	T load() const { return this->get(); }
+	void store(T v) { this->set(v); }
+	operator T() const { return this->get(); }
+	T operator=(T v) { this->set(v); return v; }
+	T exchange(T v) { return this->swap(v); }
+	bool compare_exchange_weak(T& expected, T desired) { return this->cas(expected, desired, true); }
+	bool compare_exchange_strong(T& expected, T desired) { return this->cas(expected, desired, false); }
+	bool is_lock_free() const { return base::is_always_lock_free; }
+
+	// For integer and pointer types only
+	template <class U> T fetch_add(U arg) { return this->update([arg](T v) { return (T)(v + arg); }); }
+	template <class U> T fetch_sub(U arg) { return this->update([arg](T v) { return (T)(v - arg); }); }
+	T fetch_and(T arg) { return this->update([arg](T v) { return (T)(v & arg); }); }
+	T fetch_or(T arg) { return this->update([arg](T v) { return (T)(v | arg); }); }
+	T fetch_xor(T arg) { return this->update([arg](T v) { return (T)(v ^ arg); }); }
+	T operator++() { return fetch_add(1) + 1; }
+	T operator++(int) { return fetch_add(1); }
+	T operator--() { return fetch_sub(1) - 1; }
+	T operator--(int) { return fetch_sub(1); }
+	template <class U> T operator+=(U arg) { return fetch_add(arg) + arg; }
+	template <class U> T operator-=(U arg) { return fetch_sub(arg) - arg; }
+	T operator&=(T arg) { return fetch_and(arg) & arg; }
+	T operator|=(T arg) { return fetch_or(arg) | arg; }
+	T operator^=(T arg) { return fetch_xor(arg) ^ arg; }
+
+	// Block until the value differs from 'old'; returns early after threads.interrupt()
+	void wait(T old) const {
+		while (1) {
+			threads.prepareWait(this);
+			T v = load();
+			if (__builtin_memcmp(&v, &old, sizeof(T)) != 0 || threads.interrupted()) {
+				threads.cancelWait();
+				return;
+			}
+			threads.commitWait(0);
+		}
+	}
+	// Wake one or all threads in wait(); safe to call from interrupts
+	void notify_one() { threads.wakeOne(this); }
+	void notify_all() { threads.wakeAll(this); }
+};
+
 /*
 * Rudimentary compliance to C++11 class
 *
@@ -328,28 +915,190 @@ extern Threads threads;
 *
 * Example:
 * int x;
-* void thread_func() { x++; }
+* void thread_func(int n) { x += n; }
 * int main() {
-*   std::thread(thread_func);
+*   std::thread t1(thread_func, 2);
+*   std::thread t2([&x]() { x++; });
 * }
 *
 */
 namespace std {
+	namespace threads_detail {
+		// std::invoke() is C++17; this covers functions, callable objects and
+		// member functions called on an object or a pointer to one
+		template <class F, class... A> auto invoke(F&& f, A&&... a)
+			-> decltype(std::forward<F>(f)(std::forward<A>(a)...)) {
+			return std::forward<F>(f)(std::forward<A>(a)...);
+		}
+		template <class M, class C, class O, class... A> auto invoke(M C::*m, O&& o, A&&... a)
+			-> decltype((std::forward<O>(o).*m)(std::forward<A>(a)...)) {
+			return (std::forward<O>(o).*m)(std::forward<A>(a)...);
+		}
+		template <class M, class C, class O, class... A> auto invoke(M C::*m, O&& o, A&&... a)
+			-> decltype(((*std::forward<O>(o)).*m)(std::forward<A>(a)...)) {
+			return ((*std::forward<O>(o)).*m)(std::forward<A>(a)...);
+		}
+
+		template <size_t... I> struct indices { };
+		template <size_t N, size_t... I> struct make_indices : make_indices<N-1, N-1, I...> { };
+		template <size_t... I> struct make_indices<0, I...> { typedef indices<I...> type; };
+
+		// The callable and copies of its arguments, kept at the top of the thread's stack
+		template <class F, class... A> struct call {
+			F f;
+			std::tuple<A...> args;
+			template <class G, class... B> call(G&& g, B&&... b)
+				: f(std::forward<G>(g)), args(std::forward<B>(b)...) { }
+			template <size_t... I> void run(indices<I...>) {
+				invoke(std::move(f), std::move(std::get<I>(args))...);
+			}
+			static void process(void *arg) {
+				call *c = (call*)arg;
+				c->run(typename make_indices<sizeof...(A)>::type());
+				c->~call();
+			}
+			// ctx is a tuple of references to what was passed to std::thread
+			template <class Refs, size_t... I> static void construct(void *storage, Refs &refs, indices<I...>) {
+				new (storage) call(std::forward<typename std::tuple_element<I, Refs>::type>(std::get<I>(refs))...);
+			}
+			template <class Refs> static void init(void *storage, void *ctx) {
+				construct(storage, *(Refs*)ctx, typename make_indices<std::tuple_size<Refs>::value>::type());
+			}
+		};
+	}
+
+	struct nostopstate_t { explicit nostopstate_t() = default; };
+	static const nostopstate_t nostopstate{};
+
+	namespace threads_detail {
+		// Callback registered with a stop state; see std::stop_callback
+		struct stop_node {
+			stop_node *next;
+			void (*run)(stop_node *node);
+			volatile int state;             // 0 registered, 1 running, 2 done
+		};
+		// Shared by a stop_source, its tokens and callbacks, from a fixed pool
+		struct stop_state {
+			volatile int refs;              // 0 if free
+			volatile int requested;
+			volatile int thread;            // thread to interrupt on request, or -1
+			volatile uint32_t done;         // set when a std::jthread's function returns
+			stop_node *callbacks;
+			static stop_state *alloc();     // 0 if the pool is used up
+			void addRef();
+			void release();
+			bool request();
+			void add(stop_node *node);      // runs it at once if already requested
+			void remove(stop_node *node);
+		};
+	}
+
+	// Tells a thread that it has been asked to stop; see std::stop_source
+	class stop_token {
+		friend class stop_source;
+		template <class C> friend class stop_callback;
+		threads_detail::stop_state *state;
+		explicit stop_token(threads_detail::stop_state *s) : state(s) { if (state) state->addRef(); }
+	public:
+		stop_token() : state(0) { }
+		stop_token(const stop_token& other) : state(other.state) { if (state) state->addRef(); }
+		stop_token(stop_token&& other) : state(other.state) { other.state = 0; }
+		stop_token& operator=(const stop_token& other) {
+			if (other.state) other.state->addRef();
+			if (state) state->release();
+			state = other.state;
+			return *this;
+		}
+		stop_token& operator=(stop_token&& other) {
+			if (this != &other) {
+				if (state) state->release();
+				state = other.state;
+				other.state = 0;
+			}
+			return *this;
+		}
+		~stop_token() { if (state) state->release(); }
+		bool stop_requested() const { return state && state->requested; }
+		bool stop_possible() const { return state && (state->requested || state->refs > 1); }
+	};
+
+	// Requests a stop. The stop callbacks run in the thread calling request_stop(), and if
+	// the source belongs to a std::jthread, its thread is interrupted (threads.interrupt())
+	// so that sleeps and other waits return early.
+	class stop_source {
+		friend class jthread;
+		threads_detail::stop_state *state;
+	public:
+		stop_source() : state(threads_detail::stop_state::alloc()) { }
+		explicit stop_source(nostopstate_t) : state(0) { }
+		stop_source(const stop_source& other) : state(other.state) { if (state) state->addRef(); }
+		stop_source(stop_source&& other) : state(other.state) { other.state = 0; }
+		stop_source& operator=(const stop_source& other) {
+			if (other.state) other.state->addRef();
+			if (state) state->release();
+			state = other.state;
+			return *this;
+		}
+		stop_source& operator=(stop_source&& other) {
+			if (this != &other) {
+				if (state) state->release();
+				state = other.state;
+				other.state = 0;
+			}
+			return *this;
+		}
+		~stop_source() { if (state) state->release(); }
+		stop_token get_token() const { return stop_token(state); }
+		bool stop_possible() const { return state != 0; }
+		bool stop_requested() const { return state && state->requested; }
+		// Returns true if this call made the request
+		bool request_stop() { return state && state->request(); }
+	};
+
+	// Calls a function when a stop is requested, or right away if it already was. The
+	// destructor waits if the callback is running in another thread.
+	template <class Callback> class stop_callback : threads_detail::stop_node {
+		threads_detail::stop_state *state;
+		Callback callback;
+		static void call(threads_detail::stop_node *node) { ((stop_callback*)node)->callback(); }
+	public:
+		typedef Callback callback_type;
+		template <class C> explicit stop_callback(const stop_token& token, C&& cb)
+			: state(token.state), callback(std::forward<C>(cb)) {
+			this->run = call;
+			if (state) {
+				state->addRef();
+				state->add(this);
+			}
+		}
+		stop_callback(const stop_callback&) = delete;
+		stop_callback& operator=(const stop_callback&) = delete;
+		~stop_callback() {
+			if (state) {
+				state->remove(this);
+				state->release();
+			}
+		}
+	};
+
 	class thread {
 	private:
 		int id;          // internal thread id
 		int destroy;     // flag to kill thread on instance destruction
 	public:
-		// By casting all (args...) to (void*), if there are more than one args, the compiler
-		// will fail to find a matching function. This fancy template just allows any kind of
-		// function to match.
+		// The callable and decayed copies of the arguments are moved to the top of the new
+		// thread's stack and called from there, as std::invoke() would.
 		template <class F, class ...Args> explicit thread(F&& f, Args&&... args) {
-			id = threads.addThread((ThreadFunction)f, (void*)args...);
+			typedef threads_detail::call<typename decay<F>::type, typename decay<Args>::type...> call_t;
+			typedef std::tuple<F&&, Args&&...> refs_t;
+			refs_t refs(std::forward<F>(f), std::forward<Args>(args)...);
+			id = threads.addThreadStorage(call_t::process, sizeof(call_t),
+				call_t::template init<refs_t>, &refs);
 			destroy = 1;
 		}
 		// If thread has not been detached when destructor called, then thread must end
 		~thread() {
-			if (destroy) threads.kill(id);
+			if (destroy && id != -1) threads.kill(id);
 		}
 		// Threads are joinable until detached per definition, but in this implementation
 		// that's not so. We emulate expected behavior anyway.
@@ -365,6 +1114,305 @@ namespace std {
 		int get_id() { return id; }
 	};
 
+	namespace this_thread {
+		// Sleep for at least 'd', at tick resolution (1 millisecond unless using setMicroTimer())
+		template <class Rep, class Period> void sleep_for(const chrono::duration<Rep, Period>& d) {
+			if (d <= d.zero()) return;
+			int64_t us = chrono::duration_cast<chrono::microseconds>(d).count();
+			if (chrono::microseconds(us) < d) us++;
+			int tick = threads.getTickMicros();
+			// one more tick because the current one has already begun
+			threads.sleepTicks((us + tick - 1) / tick + 1);
+		}
+		// Sleep until Clock reaches 't'
+		template <class Clock, class Duration> void sleep_until(const chrono::time_point<Clock, Duration>& t) {
+			typename Clock::time_point now;
+			while ((now = Clock::now()) < t) sleep_for(t - now);
+		}
+		inline void yield() { threads.yield(); }
+		// Same id as threads.id() and std::thread::get_id()
+		inline int get_id() { return threads.id(); }
+	}
+
+	// Like std::thread, but the destructor asks the thread to stop and waits for it to end
+	// instead of killing it. If the function takes a std::stop_token as first argument, it
+	// gets one for this thread's stop_source.
+	class jthread {
+		stop_source source;
+		int id;
+		template <class F, class... A> static auto call(int, stop_source& s, F& f, A&... a)
+			-> decltype(threads_detail::invoke(std::move(f), s.get_token(), std::move(a)...), void()) {
+			threads_detail::invoke(std::move(f), s.get_token(), std::move(a)...);
+		}
+		template <class F, class... A> static void call(long, stop_source&, F& f, A&... a) {
+			threads_detail::invoke(std::move(f), std::move(a)...);
+		}
+		template <class F, class... A> static void process(stop_source&& s, F&& f, A&&... a) {
+			call(0, s, f, a...);
+			// the thread id may be reused from now on, so a stop must not interrupt it,
+			// and join() waits for 'done' instead of the thread
+			if (s.state) {
+				s.state->thread = -1;
+				s.state->done = 1;
+				threads.wakeAll(&s.state->done);
+			}
+		}
+	public:
+		jthread() : source(nostopstate), id(-1) { }
+		template <class F, class... Args> explicit jthread(F&& f, Args&&... args) {
+			// stopped, so that the thread can't end before 'thread' is set
+			int old_state = threads.stop();
+			thread t(process<typename decay<F>::type, typename decay<Args>::type...>, source,
+				std::forward<F>(f), std::forward<Args>(args)...);
+			id = t.get_id();
+			t.detach();
+			if (id != -1 && source.state) source.state->thread = id;
+			// as addThreadStorage() does, start threading with the first thread
+			if (id != -1 && old_state == Threads::FIRST_RUN) old_state = Threads::STARTED;
+			threads.start(old_state);
+		}
+		jthread(jthread&& other) : source(std::move(other.source)), id(other.id) { other.id = -1; }
+		jthread& operator=(jthread&& other) {
+			if (joinable()) {
+				request_stop();
+				join();
+			}
+			source = std::move(other.source);
+			id = other.id;
+			other.id = -1;
+			return *this;
+		}
+		jthread(const jthread&) = delete;
+		jthread& operator=(const jthread&) = delete;
+		~jthread() {
+			if (joinable()) {
+				request_stop();
+				join();
+			}
+		}
+		bool joinable() const { return id != -1; }
+		// Without a stop state (the pool was used up) this waits on the thread id, which
+		// is only safe while the thread has not ended and been reused.
+		void join() {
+			threads_detail::stop_state *s = source.state;
+			if (id != -1 && s) {
+				while (!s->done) {
+					if (!threads.waitOn(&s->done, 0)) threads.yield();
+				}
+			}
+			else if (id != -1) {
+				threads.wait(id);
+			}
+			id = -1;
+		}
+		// The thread keeps running on its own; a stop can still be requested through the
+		// stop_source
+		void detach() { id = -1; }
+		int get_id() const { return id; }
+		stop_source get_stop_source() { return source; }
+		stop_token get_stop_token() const { return source.get_token(); }
+		bool request_stop() { return source.request_stop(); }
+	};
+
+	enum class future_status { ready, timeout, deferred };
+	enum class launch { async = 1, deferred = 2 };
+
+	namespace threads_detail {
+		// Shared state of a promise and its future, from a fixed pool. The thread
+		// waiting in future::get() blocks until the promise wakes it.
+		struct future_state {
+			volatile int refs;              // 0 if free
+			volatile int ready;             // 0 not yet; 1 value set; 2 promise broken
+			void (*destroy)(void *value);   // destroys the value, once set
+			uint64_t value[(THREADS_FUTURE_STORAGE + 7) / 8];
+			static future_state *alloc();   // 0 if the pool is used up
+			void addRef();
+			void release(bool promise = false);  // from the promise, or a future
+			void set_ready(int how);
+			// Blocks until ready, timeout_ms passes (0 for ever) or, if interruptible,
+			// threads.interrupt(); returns 1 if ready
+			int wait(unsigned int timeout_ms, int interruptible = 1);
+		};
+		template <class T> void destroy_value(void *value) { ((T*)value)->~T(); }
+
+		template <class Rep, class Period> unsigned int to_ms(const chrono::duration<Rep, Period>& d) {
+			if (d <= d.zero()) return 0;
+			int64_t ms = chrono::duration_cast<chrono::milliseconds>(d).count();
+			if (chrono::milliseconds(ms) < d) ms++;
+			return ms < 0x7FFFFFFF ? ms : 0x7FFFFFFF;
+		}
+
+		template <class T> class future_base {
+		protected:
+			future_state *state;
+			explicit future_base(future_state *s) : state(s) { }
+		public:
+			future_base() : state(0) { }
+			future_base(future_base&& other) : state(other.state) { other.state = 0; }
+			future_base& operator=(future_base&& other) {
+				if (state) state->release();
+				state = other.state;
+				other.state = 0;
+				return *this;
+			}
+			future_base(const future_base&) = delete;
+			future_base& operator=(const future_base&) = delete;
+			~future_base() { if (state) state->release(); }
+			bool valid() const { return state != 0; }
+			void wait() const { if (state) state->wait(0); }
+			template <class Rep, class Period> future_status wait_for(const chrono::duration<Rep, Period>& d) const {
+				if (state == 0 || state->ready) return future_status::ready;
+				if (d <= d.zero()) return future_status::timeout;
+				return state->wait(to_ms(d)) ? future_status::ready : future_status::timeout;
+			}
+			template <class Clock, class Duration> future_status wait_until(const chrono::time_point<Clock, Duration>& t) const {
+				return wait_for(t - Clock::now());
+			}
+		};
+	}
+
+	template <class T> class promise;
+
+	// The result of a promise or std::async(). get() blocks the calling thread (it is not
+	// scheduled) until the value is set, even after threads.interrupt(); use wait_for() to
+	// give up earlier. Without exceptions, a broken promise makes get() return a
+	// value-initialized T.
+	template <class T> class future : public threads_detail::future_base<T> {
+		friend class promise<T>;
+		explicit future(threads_detail::future_state *s) : threads_detail::future_base<T>(s) { }
+	public:
+		future() { }
+		T get() {
+			threads_detail::future_state *s = this->state;
+			this->state = 0;
+			if (s == 0) return T();
+			s->wait(0, 0);
+			if (s->ready != 1) {
+				s->release();
+				return T();
+			}
+			T value(std::move(*(T*)s->value));
+			s->release();
+			return value;
+		}
+	};
+
+	template <> class future<void> : public threads_detail::future_base<void> {
+		friend class promise<void>;
+		explicit future(threads_detail::future_state *s) : threads_detail::future_base<void>(s) { }
+	public:
+		future() { }
+		void get() {
+			if (state == 0) return;
+			state->wait(0, 0);
+			state->release();
+			state = 0;
+		}
+	};
+
+	// A value to be set by one thread and waited for by another through its future.
+	// If the pool of shared states is used up, the future is not valid().
+	template <class T> class promise {
+		threads_detail::future_state *state;
+		int retrieved;
+	public:
+		promise() : state(threads_detail::future_state::alloc()), retrieved(0) {
+			static_assert(sizeof(T) <= THREADS_FUTURE_STORAGE, "promise value too large; see THREADS_FUTURE_STORAGE");
+		}
+		promise(promise&& other) : state(other.state), retrieved(other.retrieved) { other.state = 0; }
+		promise& operator=(promise&& other) {
+			if (state) state->release(true);
+			state = other.state;
+			retrieved = other.retrieved;
+			other.state = 0;
+			return *this;
+		}
+		promise(const promise&) = delete;
+		promise& operator=(const promise&) = delete;
+		~promise() { if (state) state->release(true); }
+		future<T> get_future() {
+			if (state == 0 || retrieved) return future<T>();
+			retrieved = 1;
+			state->addRef();
+			return future<T>(state);
+		}
+		template <class U> void set_value(U&& value) {
+			if (state == 0 || state->ready) return;
+			new (state->value) T(std::forward<U>(value));
+			state->destroy = threads_detail::destroy_value<T>;
+			state->set_ready(1);
+		}
+	};
+
+	template <> class promise<void> {
+		threads_detail::future_state *state;
+		int retrieved;
+	public:
+		promise() : state(threads_detail::future_state::alloc()), retrieved(0) { }
+		promise(promise&& other) : state(other.state), retrieved(other.retrieved) { other.state = 0; }
+		promise& operator=(promise&& other) {
+			if (state) state->release(true);
+			state = other.state;
+			retrieved = other.retrieved;
+			other.state = 0;
+			return *this;
+		}
+		promise(const promise&) = delete;
+		promise& operator=(const promise&) = delete;
+		~promise() { if (state) state->release(true); }
+		future<void> get_future() {
+			if (state == 0 || retrieved) return future<void>();
+			retrieved = 1;
+			state->addRef();
+			return future<void>(state);
+		}
+		void set_value() {
+			if (state == 0 || state->ready) return;
+			state->set_ready(1);
+		}
+	};
+
+	namespace threads_detail {
+		template <class R> struct async_result {
+			template <class F, class... A> static void run(promise<R>& p, F&& f, A&&... a) {
+				p.set_value(invoke(std::forward<F>(f), std::forward<A>(a)...));
+			}
+		};
+		template <> struct async_result<void> {
+			template <class F, class... A> static void run(promise<void>& p, F&& f, A&&... a) {
+				invoke(std::forward<F>(f), std::forward<A>(a)...);
+				p.set_value();
+			}
+		};
+		template <class R, class F, class... A> void async_process(promise<R>&& p, F&& f, A&&... a) {
+			async_result<R>::run(p, std::move(f), std::move(a)...);
+		}
+		// Result of calling decayed copies of f(args...), like std::invoke_result
+		template <class F, class... A> using async_t =
+			decltype(invoke(declval<typename decay<F>::type>(), declval<typename decay<A>::type>()...));
+	}
+
+	// Run f(args...) on a new thread and return a future for its result. The policy is
+	// accepted for compatibility; the call always runs on its own thread. If no thread or
+	// shared state is available, the future is not valid().
+	template <class F, class... Args>
+	future<threads_detail::async_t<F, Args...>> async(launch, F&& f, Args&&... args) {
+		typedef threads_detail::async_t<F, Args...> R;
+		promise<R> p;
+		future<R> result = p.get_future();
+		if (!result.valid()) return result;
+		thread t(threads_detail::async_process<R, typename decay<F>::type, typename decay<Args>::type...>,
+			std::move(p), std::forward<F>(f), std::forward<Args>(args)...);
+		t.detach();
+		if (t.get_id() == -1) return future<R>();
+		return result;
+	}
+
+	template <class F, class... Args>
+	future<threads_detail::async_t<F, Args...>> async(F&& f, Args&&... args) {
+		return async(launch::async, std::forward<F>(f), std::forward<Args>(args)...);
+	}
+
 	class mutex {
 	private:
 		Threads::Mutex mx;
@@ -374,6 +1422,88 @@ namespace std {
 		void unlock() { mx.unlock(); }
 	};
 
+	class recursive_mutex {
+	private:
+		Threads::RecursiveMutex mx;
+	public:
+		void lock() { mx.lock(); }
+		bool try_lock() { return mx.try_lock(); }
+		void unlock() { mx.unlock(); }
+	};
+
+	namespace threads_detail {
+		template <class M> class timed_mutex {
+		private:
+			M mx;
+		public:
+			void lock() { mx.lock(); }
+			bool try_lock() { return mx.try_lock(); }
+			void unlock() { mx.unlock(); }
+			template <class Rep, class Period> bool try_lock_for(const chrono::duration<Rep, Period>& d) {
+				unsigned int ms = to_ms(d);
+				return ms ? mx.lock(ms) : mx.try_lock();
+			}
+			template <class Clock, class Duration> bool try_lock_until(const chrono::time_point<Clock, Duration>& t) {
+				return try_lock_for(t - Clock::now());
+			}
+		};
+	}
+
+	class timed_mutex : public threads_detail::timed_mutex<Threads::Mutex> { };
+	class recursive_timed_mutex : public threads_detail::timed_mutex<Threads::RecursiveMutex> { };
+
+	class shared_mutex {
+	private:
+		Threads::RwLock rw;
+	public:
+		void lock() { rw.lock(); }
+		bool try_lock() { return rw.try_lock(); }
+		void unlock() { rw.unlock(); }
+		void lock_shared() { rw.lock_shared(); }
+		bool try_lock_shared() { return rw.try_lock_shared(); }
+		void unlock_shared() { rw.unlock_shared(); }
+	};
+
+	namespace threads_detail {
+		struct no_completion { void operator()() { } };
+	}
+
+	template <class CompletionFunction = threads_detail::no_completion> class barrier {
+	private:
+		Threads::Barrier b;
+		CompletionFunction completion;
+		static void complete(void *arg) { ((barrier*)arg)->completion(); }
+	public:
+		class arrival_token {
+			friend class barrier;
+			uint32_t phase;
+			explicit arrival_token(uint32_t phase) : phase(phase) { }
+		};
+		explicit barrier(ptrdiff_t expected, CompletionFunction f = CompletionFunction())
+			: b(expected, complete, this), completion(std::move(f)) { }
+		barrier(const barrier&) = delete;
+		barrier& operator=(const barrier&) = delete;
+		arrival_token arrive(ptrdiff_t n = 1) { return arrival_token(b.arrive(n)); }
+		void wait(arrival_token&& token) { b.wait(token.phase); }
+		void arrive_and_wait() { b.arriveAndWait(); }
+		void arrive_and_drop() { b.arriveAndDrop(); }
+		static constexpr ptrdiff_t max() { return 0x7FFFFFFF; }
+	};
+
+	class latch {
+	private:
+		mutable Threads::Latch l;
+	public:
+		explicit latch(ptrdiff_t expected) : l(expected) { }
+		latch(const latch&) = delete;
+		latch& operator=(const latch&) = delete;
+		void count_down(ptrdiff_t n = 1) { l.countDown(n); }
+		bool try_wait() const { return l.tryWait(); }
+		void wait() const { l.wait(); }
+		void arrive_and_wait(ptrdiff_t n = 1) { l.arriveAndWait(n); }
+		static constexpr ptrdiff_t max() { return 0x7FFFFFFF; }
+	};
+
 	template <class cMutex> class lock_guard {
 	private:
 		cMutex *r;
@@ -381,5 +1511,20 @@ namespace std {
 		explicit lock_guard(cMutex& m) { r = &m; r->lock(); }
 		~lock_guard() { r->unlock(); }
 	};
+
+	template <class cMutex> class shared_lock {
+	private:
+		cMutex *r;
+		bool owns;
+	public:
+		explicit shared_lock(cMutex& m) : r(&m), owns(true) { r->lock_shared(); }
+		~shared_lock() { if (owns) r->unlock_shared(); }
+		shared_lock(const shared_lock&) = delete;
+		shared_lock& operator=(const shared_lock&) = delete;
+		void lock() { r->lock_shared(); owns = true; }
+		bool try_lock() { return owns = r->try_lock_shared(); }
+		void unlock() { r->unlock_shared(); owns = false; }
+		bool owns_lock() const { return owns; }
+	};
 }
 #endif
@@ -0,0 +1,278 @@
+#include <Arduino.h>
+#include "TeensyThreads.h"
+
+/*
+ * Cycle-level benchmarks of the scheduler using the DWT cycle counter.
+ *
+ * Each benchmark collects SAMPLES measurements and prints one line of
+ * comma-separated values:
+ *
+ *   name,samples,min,median,p99
+ *
+ * All numbers are CPU cycles. The output can be captured from the serial
+ * port and compared between builds. Handoff between threads is measured
+ * with Threads::Mutex, the blocking primitive the library provides. Lines
+ * starting with '#' are comments.
+ */
+
+#define SAMPLES 200
+
+uint32_t samples[SAMPLES];
+volatile int nsamples = 0;
+
+void enable_cycle_counter() {
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+}
+
+void sort_samples(int n) {
+  for (int i=1; i<n; i++) {
+    uint32_t v = samples[i];
+    int j = i - 1;
+    while (j >= 0 && samples[j] > v) {
+      samples[j+1] = samples[j];
+      j--;
+    }
+    samples[j+1] = v;
+  }
+}
+
+void report(const char *name, int n) {
+  sort_samples(n);
+  Serial.print(name);
+  Serial.print(",");
+  Serial.print(n);
+  Serial.print(",");
+  Serial.print(samples[0]);
+  Serial.print(",");
+  Serial.print(samples[n/2]);
+  Serial.print(",");
+  Serial.println(samples[(n*99)/100]);
+}
+
+/*
+ * yield round trip: main thread yields to a single partner that yields
+ * straight back; one sample is two context switches.
+ */
+volatile int running = 0;
+
+void yield_partner() {
+  while (running) threads.yield();
+}
+
+void bench_yield() {
+  running = 1;
+  int id = threads.addThread(yield_partner);
+  threads.yield();
+  for (int i=0; i<SAMPLES; i++) {
+    uint32_t t = ARM_DWT_CYCCNT;
+    threads.yield();
+    samples[i] = ARM_DWT_CYCCNT - t;
+  }
+  running = 0;
+  threads.wait(id);
+  report("yield_round_trip", SAMPLES);
+}
+
+/*
+ * preemptive switch: every runnable thread spins stamping the cycle
+ * counter. When a thread sees that another one stamped last, the gap is the
+ * time from the last instruction of the previous thread to the first one of
+ * this thread, i.e. the tick interrupt plus the context switch.
+ */
+volatile uint32_t stamp;
+volatile int stamp_owner;
+
+void stamp_once(int me) {
+  uint32_t now = ARM_DWT_CYCCNT;
+  if (stamp_owner != me) {
+    int n = nsamples;
+    if (n < SAMPLES) {
+      samples[n] = now - stamp;
+      nsamples = n + 1;
+    }
+    stamp_owner = me;
+  }
+  stamp = ARM_DWT_CYCCNT;
+}
+
+void spin_stamp(int me) {
+  while (running) stamp_once(me);
+}
+
+void bench_preempt() {
+  nsamples = 0;
+  running = 1;
+  stamp_owner = 0;
+  stamp = ARM_DWT_CYCCNT;
+  int id = threads.addThread(spin_stamp, 1);
+  // the main thread takes part too, checking when enough samples are in
+  while (nsamples < SAMPLES) stamp_once(0);
+  running = 0;
+  threads.wait(id);
+  report("preempt_switch", SAMPLES);
+}
+
+/*
+ * mutex ping-pong: the partner blocks on a mutex held by the main thread;
+ * one sample is the time from unlock() until the partner owns the lock.
+ */
+Threads::Mutex pingpong;
+volatile int go = 0;
+volatile int done = 0;
+volatile uint32_t acquired;
+
+void mutex_partner() {
+  while (running) {
+    if (!go) { threads.yield(); continue; }
+    go = 0;
+    pingpong.lock();
+    acquired = ARM_DWT_CYCCNT;
+    pingpong.unlock();
+    done = 1;
+  }
+}
+
+void bench_mutex() {
+  running = 1;
+  int id = threads.addThread(mutex_partner);
+  for (int i=0; i<SAMPLES; i++) {
+    pingpong.lock();
+    done = 0;
+    go = 1;
+    while (threads.getState(id) != Threads::BLOCKED) threads.yield();
+    uint32_t t = ARM_DWT_CYCCNT;
+    pingpong.unlock();
+    while (!done) threads.yield();
+    samples[i] = acquired - t;
+  }
+  running = 0;
+  threads.wait(id);
+  report("mutex_handoff", SAMPLES);
+}
+
+/*
+ * thread create/exit: time from addThread() to the first instruction of the
+ * new thread, and from there until wait() sees that it has ended.
+ */
+volatile uint32_t started;
+uint32_t exit_samples[SAMPLES];
+
+void empty_thread() {
+  started = ARM_DWT_CYCCNT;
+}
+
+void bench_create() {
+  for (int i=0; i<SAMPLES; i++) {
+    uint32_t t = ARM_DWT_CYCCNT;
+    int id = threads.addThread(empty_thread);
+    threads.wait(id);
+    uint32_t e = ARM_DWT_CYCCNT;
+    samples[i] = started - t;
+    exit_samples[i] = e - started;
+  }
+  report("thread_create", SAMPLES);
+  memcpy(samples, exit_samples, sizeof(samples));
+  report("thread_exit", SAMPLES);
+}
+
+/*
+ * delay wake-up: how late threads.delay(1) returns, beyond one millisecond,
+ * while another thread competes for the CPU.
+ */
+void busy_partner() {
+  while (running);
+}
+
+void bench_delay() {
+  running = 1;
+  int id = threads.addThread(busy_partner);
+  for (int i=0; i<SAMPLES; i++) {
+    uint32_t t = ARM_DWT_CYCCNT;
+    threads.delay(1);
+    uint32_t elapsed = ARM_DWT_CYCCNT - t;
+    uint32_t expected = F_CPU / 1000;
+    samples[i] = elapsed > expected ? elapsed - expected : 0;
+  }
+  running = 0;
+  threads.wait(id);
+  report("delay_1ms_late", SAMPLES);
+}
+
+/*
+ * thread pool: cycles per trivial job, submitted in batches of POOL_BATCH to a
+ * pool of two workers, against starting a thread for every job.
+ */
+#define POOL_BATCH 16
+
+void empty_job(void *) {
+}
+
+void empty_job_thread(void *) {
+}
+
+void bench_pool() {
+  Threads::Pool pool(2, POOL_BATCH);
+  for (int i=0; i<SAMPLES; i++) {
+    uint32_t t = ARM_DWT_CYCCNT;
+    for (int j=0; j<POOL_BATCH; j++) pool.submit(empty_job);
+    pool.wait();
+    samples[i] = (ARM_DWT_CYCCNT - t) / POOL_BATCH;
+  }
+  report("pool_job", SAMPLES);      // sorts the samples
+  uint32_t pool_median = samples[SAMPLES/2];
+  for (int i=0; i<SAMPLES; i++) {
+    uint32_t t = ARM_DWT_CYCCNT;
+    for (int j=0; j<POOL_BATCH; j++) threads.wait(threads.addThread(empty_job_thread));
+    samples[i] = (ARM_DWT_CYCCNT - t) / POOL_BATCH;
+  }
+  report("thread_per_job", SAMPLES);
+  uint32_t thread_median = samples[SAMPLES/2];
+  Serial.print("# jobs/s: pool=");
+  Serial.print(F_CPU / pool_median);
+  Serial.print(" thread_per_job=");
+  Serial.println(F_CPU / thread_median);
+}
+
+/*
+ * parallel_for: cycles for one parallel_for() over FOR_SIZE elements on a
+ * pool with as many workers as there are free threads, so that most jobs are
+ * stolen from another worker's deque.
+ */
+#define FOR_SIZE 256
+#define FOR_GRAIN 8
+
+float for_data[FOR_SIZE];
+
+void bench_parallel_for() {
+  Threads::Pool pool(Threads::MAX_THREADS - 2, 64);
+  for (int i=0; i<SAMPLES; i++) {
+    uint32_t t = ARM_DWT_CYCCNT;
+    pool.parallel_for(0, FOR_SIZE, [](int j) { for_data[j] = for_data[j] * 0.5f + 1.0f; }, FOR_GRAIN);
+    samples[i] = ARM_DWT_CYCCNT - t;
+  }
+  report("parallel_for_256", SAMPLES);
+}
+
+void setup() {
+  delay(1000);
+  enable_cycle_counter();
+#ifdef THREADS_SAVE_ON_STACK
+  Serial.print("# registers saved on thread stack, sizeof(ThreadInfo)=");
+#else
+  Serial.print("# registers saved in ThreadInfo, sizeof(ThreadInfo)=");
+#endif
+  Serial.println(sizeof(ThreadInfo));
+  Serial.println("name,samples,min,median,p99");
+  bench_yield();
+  bench_preempt();
+  bench_mutex();
+  bench_create();
+  bench_delay();
+  bench_pool();
+  bench_parallel_for();
+  Serial.println("done");
+}
+
+void loop() {
+}
@@ -0,0 +1,112 @@
+#include <Arduino.h>
+#include "TeensyThreads.h"
+
+/*
+ * Coroutines sharing one thread. Needs C++20: compile with -std=gnu++20 (see
+ * the readme); otherwise it only prints a reminder.
+ *
+ * A producer passes numbers to a consumer through a queue, a few workers
+ * share a mutex and a semaphore, and 200 blinking flows sleep concurrently,
+ * all on the stack of the single executor thread. Each part prints OK or
+ * ***FAIL***.
+ */
+
+#if defined(__cpp_impl_coroutine)
+#include "TeensyThreads-coro.h"
+
+Coro::Executor executor;
+
+Coro::Queue<int, 4> queue;
+int consumed = 0;
+
+Coro::Task<> producer() {
+  for (int i=1; i<=100; i++) co_await queue.push(i);
+}
+
+Coro::Task<> consumer() {
+  for (int i=1; i<=100; i++) {
+    int v = co_await queue.pop();
+    if (v == i) consumed++;
+  }
+}
+
+Coro::Task<int> square(int x) {
+  co_await Coro::sleep(1);
+  co_return x * x;
+}
+
+int squared = 0;
+
+Coro::Task<> use_square() {
+  squared = co_await square(12);
+}
+
+Coro::Mutex mutex;
+Coro::Semaphore slots(2);
+int inside = 0;
+int max_inside = 0;
+int holders = 0;
+int locked_ok = 1;
+int workers_done = 0;
+
+Coro::Task<> worker() {
+  for (int i=0; i<10; i++) {
+    co_await slots.acquire();
+    inside++;
+    if (inside > max_inside) max_inside = inside;
+    co_await mutex.lock();
+    holders++;
+    co_await Coro::sleep(1);
+    if (holders != 1) locked_ok = 0;   // nobody else got in while we held it
+    holders--;
+    mutex.unlock();
+    inside--;
+    slots.release();
+  }
+  workers_done++;
+}
+
+#define FLOWS 200
+int flows_done = 0;
+
+Coro::Task<> flow(int n) {
+  for (int i=0; i<5; i++) co_await Coro::sleep(10 + n % 7);
+  flows_done++;
+}
+
+void check(const char *name, int ok) {
+  Serial.print("Test ");
+  Serial.print(name);
+  Serial.println(ok ? " OK" : " ***FAIL***");
+}
+
+void setup() {
+  delay(1000);
+  executor.spawn(producer());
+  executor.spawn(consumer());
+  executor.spawn(use_square());
+  for (int i=0; i<4; i++) executor.spawn(worker());
+  for (int i=0; i<FLOWS; i++) executor.spawn(flow(i));
+  executor.begin();
+  delay(2000);
+  check("queue", consumed == 100);
+  check("task value", squared == 144);
+  check("mutex", locked_ok && workers_done == 4);
+  check("semaphore", max_inside == 2);
+  check("many flows", flows_done == FLOWS);
+}
+
+void loop() {
+}
+
+#else
+
+void setup() {
+  delay(1000);
+  Serial.println("The Coroutines example needs C++20; compile with -std=gnu++20");
+}
+
+void loop() {
+}
+
+#endif
@@ -65,6 +65,167 @@ void lock_test3() {
   }
 }
 
+std::timed_mutex timed_lock;
+
+void timed_holder() {
+  timed_lock.lock();
+  threads.delay(100);
+  timed_lock.unlock();
+}
+
+Threads::Mutex intr_lock;
+volatile int intr_locked = 0;
+
+void intr_locker() {
+  intr_lock.lock();
+  intr_locked = 1;
+  intr_lock.unlock();
+}
+
+Threads::Event events;
+volatile uint32_t event_result = 0;
+
+void event_func() {
+  event_result = events.wait(0x3, Threads::Event::ALL | Threads::Event::CLEAR, 1000);
+}
+
+volatile int sync_arrived = 0;
+volatile int sync_phases = 0;
+volatile int sync_errors = 0;
+
+void sync_done() {
+  sync_phases++;
+  if (sync_arrived != 3 * sync_phases) sync_errors++;   // someone ran ahead
+}
+
+std::barrier<void (*)()> sync_point(3, sync_done);
+std::latch sync_finished(2);
+
+void sync_func() {
+  for (int i=0; i<5; i++) {
+    sync_arrived++;
+    threads.delay(i);
+    sync_point.arrive_and_wait();
+  }
+  sync_finished.count_down();
+}
+
+Threads::Atomic<int> atomic_count;
+Threads::Atomic<uint64_t> atomic_wide;
+Threads::Atomic<int> atomic_flag;
+
+void atomic_func() {
+  for (int i=0; i<10000; i++) {
+    atomic_count++;
+    atomic_wide += 3;
+  }
+}
+
+void atomic_waiter() {
+  atomic_flag.wait(0);
+  atomic_count = 1;
+}
+
+volatile uint32_t futex_word = 0;
+volatile int futex_woken = 0;
+
+void futex_func() {
+  while (futex_word == 0) threads.waitOn(&futex_word, 0);
+  futex_woken++;
+}
+
+volatile int defer_count = 0;
+volatile int defer_thread_id = -1;
+
+void defer_func(void *arg) {
+  defer_thread_id = threads.id();
+  defer_count += (int)arg;
+}
+
+void defer_isr() {
+  threads.defer(defer_func, (void*)1);
+}
+
+volatile int fair1 = 0;
+volatile int fair2 = 0;
+
+void fair_func(void *counter) {
+  volatile int *c = (volatile int *)counter;
+  while(1) (*c)++;
+}
+
+volatile int periodic_count = 0;
+
+void periodic_func() {
+  periodic_count++;
+}
+
+void periodic_hog() {
+  periodic_count++;
+  uint32_t mx = millis();
+  while (millis() - mx < 20);
+}
+
+volatile int budget_ticks = 0;
+
+// Counts the ticks it sees: one when it is switched back in and one for each
+// tick after that, so 'budget' ticks per period
+void budget_hog() {
+  uint32_t last = millis();
+  while (1) {
+    uint32_t now = millis();
+    if (now != last) budget_ticks++;
+    last = now;
+  }
+}
+
+volatile int timer_count = 0;
+
+int slow_square(int x) {
+  threads.delay(100);
+  return x * x;
+}
+
+void sleep_func() {
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+}
+
+void stop_func(std::stop_token token) {
+  while (!token.stop_requested()) threads.sleep(1000);
+}
+
+volatile int stop_calls = 0;
+
+Threads::RwLock rwlock;
+volatile int rw_value = 0;
+
+void rw_writer() {
+  rwlock.lock();
+  rw_value = 1;
+  rwlock.unlock();
+}
+
+volatile int coop_count = 0;
+
+void coop_func() {
+  for (int i=0; i<1000; i++) {
+    int v = coop_count;           // no lock: only a yield can switch us out
+    delayMicroseconds(20);
+    coop_count = v + 1;
+    if (i % 10 == 0) threads.yield();
+  }
+}
+
+volatile int pool_count = 0;
+
+void pool_func(void *arg) {
+  pool_count += (int)arg;
+}
+
+void timer_func() {
+  timer_count++;
+}
+
 int ratio_test(int a, int b, float r) {
   float f = (float)a / (float)b;
   if (a < b) f = 1.0/f;
@@ -123,6 +284,14 @@ void runtest() {
   if (rate < 1.2 && rate > 0.8) Serial.println("OK");
   else Serial.println("***FAIL***");
 
+  Serial.print("Test periodic first thread ");
+  periodic_count = 0;
+  id1 = threads.addPeriodicThread(periodic_func, 10000, 0);
+  delayx(100);
+  threads.kill(id1);
+  if (periodic_count >= 5) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
   Serial.print("Test thread start ");
   id1 = threads.addThread(my_priv_func1, 1);
   delayx(300);
@@ -216,6 +385,12 @@ void runtest() {
   if (p2 != 0) Serial.println("OK");
   else Serial.println("***FAIL***");
 
+  Serial.print("Test thread yieldTo ");
+  save_p = p2;
+  threads.yieldTo(id2);
+  if (p2 != save_p) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
   Serial.print("Test thread stop ");
   threads.stop();
   delayx(200);
@@ -266,6 +441,16 @@ void runtest() {
   if (p3 != 0 && p3 == save_p) Serial.println("OK");
   else Serial.println("***FAIL***");
 
+  Serial.print("Test std::thread arguments ");
+  {
+    int sum = 0;
+    std::thread th3([&sum](int a, int b, long c) { sum = a + b + c; }, 1, 2, 3L);
+    th3.join();
+    th3.detach();
+    if (sum == 6) Serial.println("OK");
+    else Serial.println("***FAIL***");
+  }
+
   Serial.print("Test basic lock ");
   id1 = threads.addThread(my_priv_func1, 2);
   delayx(500);
@@ -334,6 +519,119 @@ void runtest() {
   else Serial.println("***FAIL***");
   g_mutex.unlock();
 
+  Serial.print("Test recursive mutex ");
+  Threads::RecursiveMutex rmx;
+  rmx.lock();
+  r = rmx.try_lock();
+  if (r && rmx.getState() == 2 && rmx.getOwner() == threads.id() && rmx.unlock() &&
+      rmx.unlock() && rmx.getState() == 0 && rmx.unlock() == 0) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test timed mutex ");
+  id1 = threads.addThread(timed_holder);
+  delayx(10);
+  uint32_t timed_start = millis();
+  bool timed_early = timed_lock.try_lock_for(std::chrono::milliseconds(20));
+  uint32_t timed_wait = millis() - timed_start;
+  bool timed_later = timed_lock.try_lock_for(std::chrono::milliseconds(500));
+  if (timed_later) timed_lock.unlock();
+  if (!timed_early && timed_wait >= 20 && timed_wait <= 22 && timed_later) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test interrupted lock ");
+  intr_locked = 0;
+  intr_lock.lock();
+  id1 = threads.addThread(intr_locker);
+  delayx(10);
+  threads.interrupt(id1);
+  delayx(10);
+  int intr_early = intr_locked;   // must still be waiting for the lock
+  intr_lock.unlock();
+  threads.wait(id1, 1000);
+  if (!intr_early && intr_locked) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test event flags ");
+  event_result = 0;
+  id1 = threads.addThread(event_func);
+  delayx(10);
+  events.set(0x1);
+  delayx(10);
+  int event_state = threads.getState(id1);   // still waiting for 0x2
+  events.set(0x6);
+  threads.wait(id1, 1000);
+  uint32_t event_start = millis();
+  uint32_t event_timeout = events.wait(0x1, Threads::Event::ANY, 20);
+  uint32_t event_wait = millis() - event_start;
+  if (event_state == Threads::BLOCKED && event_result == 0x7 && events.get() == 0x4 &&
+      event_timeout == 0 && event_wait >= 20 && event_wait <= 22) Serial.println("OK");
+  else Serial.println("***FAIL***");
+  events.clear(0xFFFFFFFF);
+
+  Serial.print("Test barrier and latch ");
+  id1 = threads.addThread(sync_func);
+  id2 = threads.addThread(sync_func);
+  for (int i=0; i<5; i++) {
+    sync_arrived++;
+    sync_point.arrive_and_wait();
+  }
+  sync_finished.wait();
+  if (sync_phases == 5 && sync_errors == 0 && sync_finished.try_wait()) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test atomics ");
+  atomic_count = 0;
+  atomic_wide = 0;
+  id1 = threads.addThread(atomic_func);
+  id2 = threads.addThread(atomic_func);
+  threads.wait(id1, 2000);
+  threads.wait(id2, 2000);
+  if (atomic_count == 20000 && atomic_wide == 60000 && atomic_count.is_lock_free() &&
+      !atomic_wide.is_lock_free()) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test atomic wait ");
+  atomic_count = 0;
+  atomic_flag = 0;
+  id1 = threads.addThread(atomic_waiter);
+  delayx(10);
+  int atomic_state = threads.getState(id1);
+  atomic_flag = 1;
+  atomic_flag.notify_one();
+  threads.wait(id1, 1000);
+  if (atomic_state == Threads::BLOCKED && atomic_count == 1) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test waitOn ");
+  futex_word = 0;
+  futex_woken = 0;
+  id1 = threads.addThread(futex_func);
+  id2 = threads.addThread(futex_func);
+  delayx(10);
+  int futex_state = threads.getState(id1);
+  int futex_none = threads.wakeAll(&futex_word + 1);  // nobody waits there
+  futex_word = 1;
+  int futex_count = threads.wakeAll(&futex_word);
+  threads.wait(id1, 1000);
+  threads.wait(id2, 1000);
+  if (futex_state == Threads::BLOCKED && futex_none == 0 && futex_count == 2 &&
+      futex_woken == 2) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test defer ");
+  int defer_id = threads.beginDefer();
+  IntervalTimer defer_timer;
+  defer_timer.begin(defer_isr, 1000);
+  delayx(20);
+  defer_timer.end();
+  delayx(5);
+  int defer_isr_count = defer_count;
+  threads.defer(defer_func, (void*)100);
+  delayx(5);
+  if (defer_id != -1 && defer_isr_count >= 10 && defer_count == defer_isr_count + 100 &&
+      defer_thread_id == defer_id) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
   Serial.print("Test Grab init ");
   subinst.h(10);
   ThreadWrap(subinst, sub2);
@@ -349,6 +647,167 @@ void runtest() {
   Serial.print("Test Grab lock ");
   if (subinst.test(&(sub2.getLock())) == 1) Serial.println("OK");
   else Serial.println("***FAIL***");
+
+  Serial.print("Test fair share weights ");
+  threads.setScheduler(Threads::FAIR_SHARE);
+  id1 = threads.addThread(fair_func, (void*)&fair1);
+  id2 = threads.addThread(fair_func, (void*)&fair2);
+  threads.setWeight(id2, 2 * Threads::DEFAULT_WEIGHT);
+  delayx(2000);
+  threads.kill(id1);
+  threads.kill(id2);
+  threads.setScheduler(Threads::ROUND_ROBIN);
+  rate = (float)fair2 / (float)fair1;
+  if (rate > 1.8 && rate < 2.2) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Fair share ratio: ");
+  Serial.println(rate);
+
+  Serial.print("Test periodic thread ");
+  periodic_count = 0;
+  id1 = threads.addPeriodicThread(periodic_func, 10000, 1000);
+  delayx(1000);
+  threads.kill(id1);
+  if (periodic_count >= 95 && periodic_count <= 105) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test periodic deadline misses ");
+  if (threads.getDeadlineMisses(id1) == 0) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test periodic admission ");
+  id1 = threads.addPeriodicThread(periodic_func, 10000, 6000);
+  id2 = threads.addPeriodicThread(periodic_func, 10000, 6000);
+  threads.kill(id1);
+  if (id1 != -1 && id2 == -1) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test periodic budget ");
+  periodic_count = 0;
+  id1 = threads.addPeriodicThread(periodic_hog, 10000, 2000);
+  delayx(500);
+  threads.kill(id1);
+  if (threads.getBudgetOverruns(id1) > 0 && periodic_count > 0) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test periodic budget ticks ");
+  budget_ticks = 0;
+  id1 = threads.addPeriodicThread(budget_hog, 10000, 2000);
+  delayx(100);
+  threads.kill(id1);
+  // 10 periods of 2 ticks, give or take the first and last
+  if (budget_ticks >= 17 && budget_ticks <= 22) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test timer once ");
+  Threads::Timer tm;
+  timer_count = 0;
+  tm.once(timer_func, 100);
+  delayx(300);
+  if (timer_count == 1 && !tm.isActive()) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test timer periodic ");
+  timer_count = 0;
+  tm.begin(timer_func, 10);
+  delayx(1000);
+  tm.end();
+  if (timer_count >= 95 && timer_count <= 105) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test sleep ");
+  id1 = threads.addThread(sleep_func);
+  delayx(50);
+  int sleep_state = threads.getState(id1);
+  uint32_t sleep_start = millis();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  uint32_t slept = millis() - sleep_start;
+  threads.wait(id1, 1000);
+  if (sleep_state == Threads::SLEEPING && slept >= 50 && slept <= 52 &&
+      threads.getState(id1) == Threads::ENDED) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test future ");
+  {
+    std::future<int> fut = std::async(slow_square, 9);
+    std::future_status early = fut.wait_for(std::chrono::milliseconds(10));
+    int value = fut.get();
+    std::promise<int> prom;
+    std::future<int> fut2 = prom.get_future();
+    prom.set_value(5);
+    if (early == std::future_status::timeout && value == 81 && fut2.get() == 5) Serial.println("OK");
+    else Serial.println("***FAIL***");
+  }
+
+  Serial.print("Test jthread stop ");
+  {
+    uint32_t stop_start = millis();
+    {
+      std::jthread jt(stop_func);
+      auto count_stop = []() { stop_calls++; };
+      std::stop_callback<decltype(count_stop)> cb(jt.get_stop_token(), count_stop);
+      delayx(20);
+      jt.request_stop();    // interrupts the thread's sleep
+      jt.join();
+      std::jthread jt2(stop_func);
+      delayx(20);
+    }   // the destructor asks jt2 to stop and joins it
+    uint32_t stop_time = millis() - stop_start;
+    if (stop_calls == 1 && stop_time < 100) Serial.println("OK");
+    else Serial.println("***FAIL***");
+  }
+
+  Serial.print("Test reader-writer lock ");
+  {
+    rw_value = 0;
+    rwlock.lock_shared();
+    int shared = rwlock.try_lock_shared();  // readers share
+    id1 = threads.addThread(rw_writer);
+    delayx(20);
+    int writer_state = threads.getState(id1);
+    int reader_blocked = !rwlock.try_lock_shared();  // a writer is waiting
+    rwlock.unlock_shared();
+    if (shared) rwlock.unlock_shared();
+    threads.wait(id1, 1000);
+    if (shared && writer_state == Threads::BLOCKED && reader_blocked && rw_value == 1 &&
+        rwlock.getState() == 0) Serial.println("OK");
+    else Serial.println("***FAIL***");
+  }
+
+  Serial.print("Test cooperative threads ");
+  coop_count = 0;
+  int coop_state = threads.stop();  // cooperative before they first run
+  id1 = threads.addThread(coop_func);
+  id2 = threads.addThread(coop_func);
+  threads.setCooperative(id1);
+  threads.setCooperative(id2);
+  threads.start(coop_state);
+  threads.wait(id1);
+  threads.wait(id2);
+  if (coop_count == 2000) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test thread pool ");
+  Threads::Pool pool(2, 8);
+  pool_count = 0;
+  for (int i=0; i<50; i++) {
+    while (!pool.submit(pool_func, (void*)1)) threads.yield();
+    while (!pool.submit([]() { pool_count += 2; })) threads.yield();
+  }
+  pool.wait();
+  if (pool_count == 150) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test parallel_for ");
+  static int squares[100];
+  pool.parallel_for(0, 100, [](int i) { squares[i] = i * i; }, 10);
+  pool_count = 0;
+  pool.parallel_invoke([]() { pool_count += 1; }, []() { pool_count += 2; });
+  int sq_ok = 1;
+  for (int i=0; i<100; i++) if (squares[i] != i * i) sq_ok = 0;
+  if (sq_ok && pool_count == 3) Serial.println("OK");
+  else Serial.println("***FAIL***");
 }
 
 void runloop() {